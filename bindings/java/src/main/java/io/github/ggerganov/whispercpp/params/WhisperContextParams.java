@@ -40,6 +40,15 @@ public class WhisperContextParams extends Structure {
     /** DTW memory size (internal use) */
     public NativeLong dtw_mem_size;
 
+    /** Memory-map the model file (default = true) */
+    public CBool use_mmap;
+
+    /** Populate the memory mapping up front (default = false) */
+    public CBool mmap_prefetch;
+
+    /** Directory (e.g. /dev/shm) holding the weight arenas shared between processes (default = null) */
+    public String weight_arena_dir;
+
     /** Use GPU for inference */
     public void useGpu(boolean enable) {
         use_gpu = enable ? CBool.TRUE : CBool.FALSE;
@@ -55,6 +64,11 @@ public class WhisperContextParams extends Structure {
         dtw_token_timestamps = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Memory-map the model file */
+    public void useMmap(boolean enable) {
+        use_mmap = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
     /** Set DTW alignment heads preset */
     public void setDtwAheadsPreset(int preset) {
         dtw_aheads_preset = preset;
@@ -70,7 +84,10 @@ public class WhisperContextParams extends Structure {
             "dtw_aheads_preset",
             "dtw_n_top",
             "dtw_aheads",
-            "dtw_mem_size"
+            "dtw_mem_size",
+            "use_mmap",
+            "mmap_prefetch",
+            "weight_arena_dir"
         );
     }
 
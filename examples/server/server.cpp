@@ -19,6 +19,9 @@
 #include <atomic>
 #include <functional>
 #include <cstdlib>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
 #if defined (_WIN32)
 #include <windows.h>
 #endif
@@ -65,6 +68,13 @@ struct server_params
     int32_t read_timeout  = 600;
     int32_t write_timeout = 600;
 
+    int32_t n_parallel    = 1;  // number of requests processed concurrently
+    int32_t n_queue       = 16; // max number of requests waiting for a free slot
+    int32_t queue_timeout = 60; // seconds a request waits for a free slot
+
+    bool    batch_decode  = false; // pack the decoder steps of the parallel requests into a single graph
+    int32_t batch_wait_us = 2000;  // how long a decoder step waits for the other requests
+
     bool ffmpeg_converter = false;
 };
 
@@ -147,7 +157,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -sow,      --split-on-word     [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
-    fprintf(stderr, "  -ac N,     --audio-ctx N       [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
+    fprintf(stderr, "  -ac N,     --audio-ctx N       [%-7d] audio context size (0 - all, -1 - auto)\n",        params.audio_ctx);
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
@@ -174,6 +184,11 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  --request-path PATH,           [%-7s] Request path for all requests\n", sparams.request_path.c_str());
     fprintf(stderr, "  --inference-path PATH,         [%-7s] Inference path for all requests\n", sparams.inference_path.c_str());
     fprintf(stderr, "  --convert,                     [%-7s] Convert audio to WAV, requires ffmpeg on the server\n", sparams.ffmpeg_converter ? "true" : "false");
+    fprintf(stderr, "  -np N,     --parallel N        [%-7d] number of requests processed in parallel\n", sparams.n_parallel);
+    fprintf(stderr, "  --queue N,                     [%-7d] max requests waiting for a free slot (429 when full)\n", sparams.n_queue);
+    fprintf(stderr, "  --queue-timeout N,             [%-7d] seconds to wait for a free slot (503 on timeout)\n", sparams.queue_timeout);
+    fprintf(stderr, "  --batch-decode,                [%-7s] batch the decoder steps of the parallel requests\n", sparams.batch_decode ? "true" : "false");
+    fprintf(stderr, "  --batch-wait N,                [%-7d] microseconds a batched decoder step waits for the other requests\n", sparams.batch_wait_us);
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n", params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  -nth N,    --no-speech-thold N [%-7.2f] no speech threshold\n",   params.no_speech_thold);
     fprintf(stderr, "  -nc,       --no-context        [%-7s] do not use previous audio context\n", params.no_context ? "true" : "false");
@@ -248,6 +263,11 @@ bool whisper_params_parse(int argc, char ** argv, whisper_params & params, serve
         else if (                  arg == "--request-path")    { sparams.request_path = argv[++i]; }
         else if (                  arg == "--inference-path")  { sparams.inference_path = argv[++i]; }
         else if (                  arg == "--convert")         { sparams.ffmpeg_converter     = true; }
+        else if (arg == "-np"   || arg == "--parallel")        { sparams.n_parallel    = std::stoi(argv[++i]); }
+        else if (                  arg == "--queue")           { sparams.n_queue       = std::stoi(argv[++i]); }
+        else if (                  arg == "--queue-timeout")   { sparams.queue_timeout = std::stoi(argv[++i]); }
+        else if (                  arg == "--batch-decode")    { sparams.batch_decode  = true; }
+        else if (                  arg == "--batch-wait")      { sparams.batch_wait_us = std::stoi(argv[++i]); }
 
         // Voice Activity Detection (VAD)
         else if (                  arg == "--vad")                         { params.vad                         = true; }
@@ -374,11 +394,11 @@ void whisper_print_progress_callback(struct whisper_context * /*ctx*/, struct wh
     }
 }
 
-void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * /*state*/, int n_new, void * user_data) {
+void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper_state * state, int n_new, void * user_data) {
     const auto & params  = *((whisper_print_user_data *) user_data)->params;
     const auto & pcmf32s = *((whisper_print_user_data *) user_data)->pcmf32s;
 
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
 
     std::string speaker = "";
 
@@ -394,8 +414,8 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
 
     for (int i = s0; i < n_segments; i++) {
         if (!params.no_timestamps || params.diarize) {
-            t0 = whisper_full_get_segment_t0(ctx, i);
-            t1 = whisper_full_get_segment_t1(ctx, i);
+            t0 = whisper_full_get_segment_t0_from_state(state, i);
+            t1 = whisper_full_get_segment_t1_from_state(state, i);
         }
 
         if (!params.no_timestamps) {
@@ -407,29 +427,29 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
         }
 
         if (params.print_colors) {
-            for (int j = 0; j < whisper_full_n_tokens(ctx, i); ++j) {
+            for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
                 if (params.print_special == false) {
-                    const whisper_token id = whisper_full_get_token_id(ctx, i, j);
+                    const whisper_token id = whisper_full_get_token_id_from_state(state, i, j);
                     if (id >= whisper_token_eot(ctx)) {
                         continue;
                     }
                 }
 
-                const char * text = whisper_full_get_token_text(ctx, i, j);
-                const float  p    = whisper_full_get_token_p   (ctx, i, j);
+                const char * text = whisper_full_get_token_text_from_state(ctx, state, i, j);
+                const float  p    = whisper_full_get_token_p_from_state   (state, i, j);
 
                 const int col = std::max(0, std::min((int) k_colors.size() - 1, (int) (std::pow(p, 3)*float(k_colors.size()))));
 
                 printf("%s%s%s%s", speaker.c_str(), k_colors[col].c_str(), text, "\033[0m");
             }
         } else {
-            const char * text = whisper_full_get_segment_text(ctx, i);
+            const char * text = whisper_full_get_segment_text_from_state(state, i);
 
             printf("%s%s", speaker.c_str(), text);
         }
 
         if (params.tinydiarize) {
-            if (whisper_full_get_segment_speaker_turn_next(ctx, i)) {
+            if (whisper_full_get_segment_speaker_turn_next_from_state(state, i)) {
                 printf("%s", params.tdrz_speaker_turn.c_str());
             }
         }
@@ -442,17 +462,17 @@ void whisper_print_segment_callback(struct whisper_context * ctx, struct whisper
     }
 }
 
-std::string output_str(struct whisper_context * ctx, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
+std::string output_str(struct whisper_state * state, const whisper_params & params, std::vector<std::vector<float>> pcmf32s) {
     std::stringstream result;
-    const int n_segments = whisper_full_n_segments(ctx);
+    const int n_segments = whisper_full_n_segments_from_state(state);
     for (int i = 0; i < n_segments; ++i) {
-        const char * text = whisper_full_get_segment_text(ctx, i);
+        const char * text = whisper_full_get_segment_text_from_state(state, i);
         std::string speaker = "";
 
         if (params.diarize && pcmf32s.size() == 2)
         {
-            const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-            const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+            const int64_t t0 = whisper_full_get_segment_t0_from_state(state, i);
+            const int64_t t1 = whisper_full_get_segment_t1_from_state(state, i);
             speaker = estimate_diarization_speaker(pcmf32s, t0, t1);
         }
 
@@ -608,6 +628,108 @@ void get_req_parameters(const Request & req, whisper_params & params)
     }
 }
 
+// pool of whisper states - each request being processed checks out one of them
+struct whisper_state_pool {
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    std::vector<whisper_state *> owned; // states created by the pool
+    std::vector<whisper_state *> idle;
+
+    // shared decoder steps of the states, with --batch-decode
+    whisper_batcher * batcher = nullptr;
+
+    int n_waiting = 0;
+};
+
+enum state_pool_status {
+    STATE_POOL_OK,
+    STATE_POOL_FULL,    // too many requests are already waiting
+    STATE_POOL_TIMEOUT, // no state became available in time
+};
+
+// the default state of the context is the first slot, so that whisper_full_parallel() can be used with a single slot
+bool state_pool_init(whisper_state_pool & pool, struct whisper_context * ctx, const server_params & sparams) {
+    pool.idle.push_back(whisper_get_state(ctx));
+
+    for (int i = 1; i < sparams.n_parallel; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            return false;
+        }
+        pool.owned.push_back(state);
+        pool.idle.push_back(state);
+    }
+
+    if (sparams.batch_decode && sparams.n_parallel > 1) {
+        pool.batcher = whisper_batcher_init(ctx, sparams.n_parallel, sparams.batch_wait_us);
+        if (pool.batcher == nullptr) {
+            return false;
+        }
+
+        for (whisper_state * state : pool.idle) {
+            if (whisper_state_set_batcher(state, pool.batcher) != 0) {
+                fprintf(stderr, "%s: WARNING: failed to attach the states to the batcher, decoding them separately\n", __func__);
+
+                for (whisper_state * s : pool.idle) {
+                    whisper_state_set_batcher(s, nullptr);
+                }
+                whisper_batcher_free(pool.batcher);
+                pool.batcher = nullptr;
+                break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// all states must have been released
+void state_pool_free(whisper_state_pool & pool) {
+    for (whisper_state * state : pool.idle) {
+        whisper_state_set_batcher(state, nullptr);
+    }
+    whisper_batcher_free(pool.batcher);
+    pool.batcher = nullptr;
+
+    for (whisper_state * state : pool.owned) {
+        whisper_free_state(state);
+    }
+    pool.owned.clear();
+    pool.idle.clear();
+}
+
+state_pool_status state_pool_acquire(whisper_state_pool & pool, const server_params & sparams, whisper_state *& state) {
+    std::unique_lock<std::mutex> lock(pool.mutex);
+
+    if (pool.idle.empty()) {
+        if (pool.n_waiting >= sparams.n_queue) {
+            return STATE_POOL_FULL;
+        }
+
+        pool.n_waiting++;
+        const bool ok = pool.cv.wait_for(lock, std::chrono::seconds(sparams.queue_timeout), [&] { return !pool.idle.empty(); });
+        pool.n_waiting--;
+
+        if (!ok) {
+            return STATE_POOL_TIMEOUT;
+        }
+    }
+
+    state = pool.idle.back();
+    pool.idle.pop_back();
+
+    return STATE_POOL_OK;
+}
+
+void state_pool_release(whisper_state_pool & pool, whisper_state * state) {
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.idle.push_back(state);
+    }
+    pool.cv.notify_one();
+}
+
 }  // namespace
 
 int main(int argc, char ** argv) {
@@ -616,13 +738,35 @@ int main(int argc, char ** argv) {
     whisper_params params;
     server_params sparams;
 
-    std::mutex whisper_mutex;
+    // inference requests hold it shared, loading a new model holds it exclusively
+    std::shared_mutex whisper_mutex;
 
     if (whisper_params_parse(argc, argv, params, sparams) == false) {
         whisper_print_usage(argc, argv, params, sparams);
         return 1;
     }
 
+    if (sparams.n_parallel < 1) {
+        fprintf(stderr, "error: --parallel must be at least 1\n");
+        whisper_print_usage(argc, argv, params, sparams);
+        exit(0);
+    }
+
+    if (sparams.n_parallel > 1) {
+        // split the cores between the requests that run in parallel
+        const int n_threads_max = std::max(1, (int) std::thread::hardware_concurrency()/sparams.n_parallel);
+        if (params.n_threads > n_threads_max) {
+            fprintf(stderr, "%s: using %d threads per request for %d parallel requests\n", __func__, n_threads_max, sparams.n_parallel);
+            params.n_threads = n_threads_max;
+        }
+
+        // whisper_full_parallel() uses the default state of the context
+        if (params.n_processors > 1) {
+            fprintf(stderr, "%s: WARNING: --processors is ignored with --parallel > 1\n", __func__);
+            params.n_processors = 1;
+        }
+    }
+
     if (params.language != "auto" && whisper_lang_id(params.language.c_str()) == -1) {
         fprintf(stderr, "error: unknown language '%s'\n", params.language.c_str());
         whisper_print_usage(argc, argv, params, sparams);
@@ -703,6 +847,13 @@ int main(int argc, char ** argv) {
 
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
+
+    whisper_state_pool state_pool;
+    if (!state_pool_init(state_pool, ctx, sparams)) {
+        fprintf(stderr, "error: failed to initialize whisper states\n");
+        return 3;
+    }
+
     state.store(SERVER_STATE_READY);
 
 
@@ -794,8 +945,14 @@ int main(int argc, char ** argv) {
     });
 
     svr->Post(sparams.request_path + sparams.inference_path, [&](const Request &req, Response &res){
-        // acquire whisper model mutex lock
-        std::lock_guard<std::mutex> lock(whisper_mutex);
+        // prevent the model from being reloaded while the request is processed
+        std::shared_lock<std::shared_mutex> lock(whisper_mutex);
+
+        if (state.load() != SERVER_STATE_READY) {
+            res.status = 503;
+            res.set_content("{\"error\":\"loading model\"}", "application/json");
+            return;
+        }
 
         // first check user requested fields of the request
         if (!req.has_file("file"))
@@ -807,9 +964,36 @@ int main(int argc, char ** argv) {
         }
         auto audio_file = req.get_file_value("file");
 
+        // the parameters of this request, starting from the defaults
+        whisper_params params = default_params;
+
         // check non-required fields
         get_req_parameters(req, params);
 
+        // wait for a free state
+        whisper_state * wstate = nullptr;
+        switch (state_pool_acquire(state_pool, sparams, wstate)) {
+            case STATE_POOL_OK:
+                break;
+            case STATE_POOL_FULL:
+                fprintf(stderr, "error: too many requests in the queue\n");
+                res.status = 429;
+                res.set_header("Retry-After", "1");
+                res.set_content("{\"error\":\"server is busy, too many requests in the queue\"}", "application/json");
+                return;
+            case STATE_POOL_TIMEOUT:
+                fprintf(stderr, "error: timed out waiting for a free slot\n");
+                res.status = 503;
+                res.set_header("Retry-After", std::to_string(sparams.queue_timeout));
+                res.set_content("{\"error\":\"server is busy, timed out waiting for a free slot\"}", "application/json");
+                return;
+        }
+
+        // return the state to the pool when done
+        std::unique_ptr<whisper_state, std::function<void(whisper_state *)>> wstate_guard(wstate, [&](whisper_state * s) {
+            state_pool_release(state_pool, s);
+        });
+
         std::string filename{audio_file.filename};
         printf("Received request: %s\n", filename.c_str());
 
@@ -962,7 +1146,12 @@ int main(int argc, char ** argv) {
             };
             wparams.abort_callback_user_data = (void*)&req;
 
-            if (whisper_full_parallel(ctx, wparams, pcmf32.data(), pcmf32.size(), params.n_processors) != 0) {
+            // with a single slot the state is the default state of the context
+            const int ret = params.n_processors > 1 ?
+                whisper_full_parallel  (ctx,         wparams, pcmf32.data(), pcmf32.size(), params.n_processors) :
+                whisper_full_with_state(ctx, wstate, wparams, pcmf32.data(), pcmf32.size());
+
+            if (ret != 0) {
                 // handle failure or early abort
                 if (req.is_connection_closed()) {
                     // log client disconnect
@@ -982,17 +1171,17 @@ int main(int argc, char ** argv) {
         // return results to user
         if (params.response_format == text_format)
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(wstate, params, pcmf32s);
             res.set_content(results.c_str(), "text/html; charset=utf-8");
         }
         else if (params.response_format == srt_format)
         {
             std::stringstream ss;
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(wstate);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(wstate, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(wstate, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(wstate, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -1010,11 +1199,11 @@ int main(int argc, char ** argv) {
 
             ss << "WEBVTT\n\n";
 
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(wstate);
             for (int i = 0; i < n_segments; ++i) {
-                const char * text = whisper_full_get_segment_text(ctx, i);
-                const int64_t t0 = whisper_full_get_segment_t0(ctx, i);
-                const int64_t t1 = whisper_full_get_segment_t1(ctx, i);
+                const char * text = whisper_full_get_segment_text_from_state(wstate, i);
+                const int64_t t0 = whisper_full_get_segment_t0_from_state(wstate, i);
+                const int64_t t1 = whisper_full_get_segment_t1_from_state(wstate, i);
                 std::string speaker = "";
 
                 if (params.diarize && pcmf32s.size() == 2)
@@ -1030,10 +1219,10 @@ int main(int argc, char ** argv) {
             res.set_content(ss.str(), "text/vtt");
         } else if (params.response_format == vjson_format) {
             /* try to match openai/whisper's Python format */
-            std::string results = output_str(ctx, params, pcmf32s); 
+            std::string results = output_str(wstate, params, pcmf32s); 
             json jres = json{
                 {"task", params.translate ? "translate" : "transcribe"},
-                {"language", whisper_lang_str_full(whisper_full_lang_id(ctx))},
+                {"language", whisper_lang_str_full(whisper_full_lang_id_from_state(wstate))},
                 {"duration", float(pcmf32.size())/WHISPER_SAMPLE_RATE},
                 {"text", results},
                 {"segments", json::array()}
@@ -1041,7 +1230,7 @@ int main(int argc, char ** argv) {
             // Only compute language probabilities if requested (expensive operation)
             if (!params.no_language_probabilities) {
                 std::vector<float> lang_probs(whisper_lang_max_id() + 1, 0.0f);
-                const auto detected_lang_id = whisper_lang_auto_detect(ctx, 0, params.n_threads, lang_probs.data());
+                const auto detected_lang_id = whisper_lang_auto_detect_with_state(ctx, wstate, 0, params.n_threads, lang_probs.data());
                 jres["detected_language"] = whisper_lang_str_full(detected_lang_id);
                 jres["detected_language_probability"] = lang_probs[detected_lang_id];
                 jres["language_probabilities"] = json::object();
@@ -1052,29 +1241,29 @@ int main(int argc, char ** argv) {
                     }
                 }
             }
-            const int n_segments = whisper_full_n_segments(ctx);
+            const int n_segments = whisper_full_n_segments_from_state(wstate);
             for (int i = 0; i < n_segments; ++i)
             {
                 json segment = json{
                     {"id", i},
-                    {"text", whisper_full_get_segment_text(ctx, i)},
+                    {"text", whisper_full_get_segment_text_from_state(wstate, i)},
                 };
 
                 if (!params.no_timestamps) {
-                    segment["start"] = whisper_full_get_segment_t0(ctx, i) * 0.01;
-                    segment["end"] = whisper_full_get_segment_t1(ctx, i) * 0.01;
+                    segment["start"] = whisper_full_get_segment_t0_from_state(wstate, i) * 0.01;
+                    segment["end"] = whisper_full_get_segment_t1_from_state(wstate, i) * 0.01;
                 }
 
                 float total_logprob = 0;
-                const int n_tokens = whisper_full_n_tokens(ctx, i);
+                const int n_tokens = whisper_full_n_tokens_from_state(wstate, i);
                 for (int j = 0; j < n_tokens; ++j) {
-                    whisper_token_data token = whisper_full_get_token_data(ctx, i, j);
+                    whisper_token_data token = whisper_full_get_token_data_from_state(wstate, i, j);
                     if (token.id >= whisper_token_eot(ctx)) {
                         continue;
                     }
 
                     segment["tokens"].push_back(token.id);
-                    json word = json{{"word", whisper_full_get_token_text(ctx, i, j)}};
+                    json word = json{{"word", whisper_full_get_token_text_from_state(ctx, wstate, i, j)}};
                     if (!params.no_timestamps) {
                         word["start"] = token.t0 * 0.01;
                         word["end"] = token.t1 * 0.01;
@@ -1090,7 +1279,7 @@ int main(int argc, char ** argv) {
 
                 // TODO compression_ratio and no_speech_prob are not implemented yet
                 // segment["compression_ratio"] = 0;
-                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob(ctx, i);
+                segment["no_speech_prob"] = whisper_full_get_segment_no_speech_prob_from_state(wstate, i);
 
                 jres["segments"].push_back(segment);
             }
@@ -1100,20 +1289,17 @@ int main(int argc, char ** argv) {
         // TODO add more output formats
         else
         {
-            std::string results = output_str(ctx, params, pcmf32s);
+            std::string results = output_str(wstate, params, pcmf32s);
             json jres = json{
                 {"text", results}
             };
             res.set_content(jres.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
         }
-
-        // reset params to their defaults
-        params = default_params;
     });
     svr->Post(sparams.request_path + "/load", [&](const Request &req, Response &res){
-        std::lock_guard<std::mutex> lock(whisper_mutex);
-        state.store(SERVER_STATE_LOADING_MODEL);
+        // wait for the requests in progress to finish
+        std::unique_lock<std::shared_mutex> lock(whisper_mutex);
         if (!req.has_file("model"))
         {
             fprintf(stderr, "error: no 'model' field in the request\n");
@@ -1130,7 +1316,10 @@ int main(int argc, char ** argv) {
             return;
         }
 
+        state.store(SERVER_STATE_LOADING_MODEL);
+
         // clean up
+        state_pool_free(state_pool);
         whisper_free(ctx);
 
         // whisper init
@@ -1145,6 +1334,11 @@ int main(int argc, char ** argv) {
         // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
         whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
+        if (!state_pool_init(state_pool, ctx, sparams)) {
+            fprintf(stderr, "error: failed to initialize whisper states, must exit\n");
+            exit(1);
+        }
+
         state.store(SERVER_STATE_READY);
         const std::string success = "Load was successful!";
         res.set_content(success, "application/text");
@@ -1180,7 +1374,7 @@ int main(int argc, char ** argv) {
     svr->set_error_handler([](const Request &req, Response &res) {
         if (res.status == 400) {
             res.set_content("Invalid request", "text/plain");
-        } else if (res.status != 500) {
+        } else if (res.status != 500 && res.status != 499 && res.status != 429 && res.status != 503) {
             res.set_content("File Not Found (" + req.path + ")", "text/plain");
             res.status = 404;
         }
@@ -1227,6 +1421,7 @@ int main(int argc, char ** argv) {
     // clean up function, to be called before exit
     auto clean_up = [&]() {
         whisper_print_timings(ctx);
+        state_pool_free(state_pool);
         whisper_free(ctx);
     };
 
@@ -300,6 +300,13 @@ int main(int argc, char** argv) {
 
     std::vector<int16_t> buffer_data(n_samples_step, 0);
     std::vector<float> pcmf32(n_samples_len, 0.0f);
+    std::vector<float> pcmf32_new(n_samples_step, 0.0f);
+
+    // the sliding window starts with silence - only the new frames are computed at each step
+    if (whisper_pcm_to_mel_append(ctx, pcmf32.data(), n_samples_len - n_samples_step, n_samples_len, params.n_threads) != 0) {
+        fprintf(stderr, "%s: failed to compute log mel spectrogram\n", argv[0]);
+        return 6;
+    }
 
     // process new audio
     int index;
@@ -313,7 +320,13 @@ int main(int argc, char** argv) {
         memmove(pcmf32.data(), pcmf32.data() + n_samples_step, sizeof(float) * (n_samples_len - n_samples_step));
 
         for (int i = 0; i < n_samples_step; i++) {
-            pcmf32[i + n_samples_len - n_samples_step] = static_cast<float>(buffer_data[i]) / 32768.0;
+            pcmf32_new[i] = static_cast<float>(buffer_data[i]) / 32768.0;
+            pcmf32[i + n_samples_len - n_samples_step] = pcmf32_new[i];
+        }
+
+        if (whisper_pcm_to_mel_append(ctx, pcmf32_new.data(), n_samples_step, n_samples_len, params.n_threads) != 0) {
+            fprintf(stderr, "%s: failed to compute log mel spectrogram\n", argv[0]);
+            return 6;
         }
 
         // run the inference
@@ -354,7 +367,8 @@ int main(int argc, char** argv) {
         wparams.vad_params.speech_pad_ms = 30;
         wparams.vad_params.samples_overlap = 0.1f;
 
-        if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+        // the spectrogram of the window is already in the state
+        if (whisper_full(ctx, wparams, nullptr, 0) != 0) {
             fprintf(stderr, "%s: failed to process audio\n", argv[0]);
             return 6;
         }
@@ -80,6 +80,7 @@ extern "C" {
     struct whisper_context;
     struct whisper_state;
     struct whisper_full_params;
+    struct whisper_batcher;
 
     typedef int32_t whisper_pos;
     typedef int32_t whisper_token;
@@ -126,6 +127,18 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        // map the model file into memory instead of reading it (whisper_init_from_file_with_params only)
+        // CPU weights are then used in place, so processes loading the same file share the page cache
+        bool use_mmap;
+        bool mmap_prefetch; // populate the mapping up front instead of faulting pages in on first use
+
+        // directory (e.g. /dev/shm) holding read-only weight arenas shared between processes (requires use_mmap)
+        // the first process to load a model writes an aligned copy of its weights there, keyed by a fingerprint
+        // of the model file - later processes attach to it, so the node keeps one physical copy of the weights
+        // the fingerprint includes the inode, size and modification time of the file: when the file changes, a new
+        // arena is created and the ones of the previous versions of the same path are removed from the directory
+        const char * weight_arena_dir;
     };
 
     typedef struct whisper_token_data {
@@ -240,6 +253,10 @@ extern "C" {
 
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
+    // The default state of the context, used by the functions that do not take a state
+    // It is owned by the context and must not be freed
+    WHISPER_API struct whisper_state * whisper_get_state(struct whisper_context * ctx);
+
     // Given a context, enable use of OpenVINO for encode inference.
     // model_path: Optional path to OpenVINO encoder IR model. If set to nullptr,
     //                      the path will be generated from the ggml model path that was passed
@@ -270,6 +287,21 @@ extern "C" {
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
     WHISPER_API void whisper_free_context_params(struct whisper_context_params * params);
 
+    // Continuous batching of the decoder across states.
+    // When several whisper_full_with_state() calls run concurrently (one thread per state) on states attached to the
+    // same batcher, their text-generation steps are packed into a single decoder graph, so the weight matmuls run at
+    // a larger batch size. Each state still attends to its own self- and cross-attention KV caches.
+    // The encoder and the prompt are not batched.
+    //   n_states_max: maximum number of states packed into one decoder step
+    //   wait_us:      how long a step waits for states that are still sampling before it runs without them
+    WHISPER_API struct whisper_batcher * whisper_batcher_init(struct whisper_context * ctx, int n_states_max, int wait_us);
+    WHISPER_API void whisper_batcher_free(struct whisper_batcher * batcher);
+
+    // Attach a state of the batcher's context to the batcher, or detach it if batcher is NULL.
+    // Must not be called while the state is in use. Not supported with dtw_token_timestamps.
+    // Returns 0 on success
+    WHISPER_API int whisper_state_set_batcher(struct whisper_state * state, struct whisper_batcher * batcher);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -286,6 +318,29 @@ extern "C" {
                                int   n_samples,
                                int   n_threads);
 
+    // Incremental version of whisper_pcm_to_mel() for audio streams.
+    // Appends n_samples new samples to the stream and updates the log mel spectrogram of the state. Only the frames that
+    // depend on the new samples are computed - the FFT overlap, the already computed frames and a running maximum for
+    // the normalization are kept in the state between calls.
+    // If n_keep > 0, the spectrogram covers only the last n_keep samples of the stream (rounded up to a whole hop).
+    // whisper_pcm_to_mel() and whisper_set_mel() reset the stream.
+    // Use whisper_full() with n_samples == 0 to transcribe the spectrogram.
+    // Returns 0 on success
+    WHISPER_API int whisper_pcm_to_mel_append(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_keep,
+                               int   n_threads);
+
+    WHISPER_API int whisper_pcm_to_mel_append_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_keep,
+                               int   n_threads);
+
     // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -318,6 +373,19 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // Run the encoder on n_windows windows in a single batched graph, so that the matmuls of all windows run as
+    // larger GEMMs. Window i starts at offsets[i] in the spectrogram of states[i], and its result is written to the
+    // cross-attention memory of states[i]. Use separate states for several windows of the same audio.
+    // The compute buffers grow with n_windows - they are allocated for the call and freed before it returns.
+    // whisper_full_parallel() uses it to encode the first window of all of its chunks at once.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+                         const int * offsets,
+                               int   n_windows,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -512,7 +580,7 @@ extern "C" {
         // [EXPERIMENTAL] speed-up techniques
         // note: these can significantly reduce the quality of the output
         bool debug_mode;        // enable debug_mode provides extra info (eg. Dump log_mel)
-        int  audio_ctx;         // overwrite the audio context size (0 = use default)
+        int  audio_ctx;         // overwrite the audio context size (0 = use default, -1 = adapt to the audio in each window)
 
         // [EXPERIMENTAL] [TDRZ] tinydiarize
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
@@ -587,6 +655,20 @@ extern "C" {
         const char * vad_model_path;              // Path to VAD model
 
         whisper_vad_params vad_params;
+
+        // [EXPERIMENTAL] skip the silence detected by the VAD in the seek loop instead of removing it from the audio
+        // the windows start at the speech segments and the timestamps need no mapping (not used by whisper_full_parallel)
+        // the audio is not copied - the mel spectrogram of the speech segments is computed from the original samples
+        bool vad_seek;
+
+        // [EXPERIMENTAL] speculative decoding, used by the greedy decoder at temperature 0
+        // the draft model proposes the next tokens and the main model verifies them with a single decode
+        // the draft model must have the same vocabulary (e.g. tiny or base for a large model of the same family)
+        // if the draft model fails, the rest of the call decodes without it
+        struct {
+            struct whisper_context * ctx; // draft model, nullptr to disable
+            int n_draft;                  // max number of tokens drafted per step
+        } speculative;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -605,6 +687,8 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // Same as whisper_full(), but the results are stored in the provided state
+    // Different states can be processed in parallel on the same context (incl. VAD, if enabled in the params)
     WHISPER_API int whisper_full_with_state(
                 struct whisper_context * ctx,
                   struct whisper_state * state,
@@ -615,8 +699,9 @@ extern "C" {
     // Split the input audio in chunks and process each chunk separately using whisper_full_with_state()
     // Result is stored in the default state of the context
     // Not thread safe if executed in parallel on the same context.
-    // It seems this approach can offer some speedup in some cases.
-    // However, the transcription accuracy can be worse at the beginning and end of each chunk.
+    // The splits are placed in pauses (between VAD segments, or at low-energy points) and neighbouring chunks
+    // overlap slightly - text transcribed twice in the overlap is removed when the results are merged.
+    // The additional states are kept in the context and reused by subsequent calls.
     WHISPER_API int whisper_full_parallel(
                 struct whisper_context * ctx,
             struct whisper_full_params   params,
@@ -694,6 +779,18 @@ extern "C" {
                            const float * samples,
                                    int   n_samples);
 
+    // Same as whisper_vad_detect_speech(), with the audio split into n_shards that are processed in parallel.
+    // Each shard starts with warmup_ms of the audio before it, to bring the LSTM state close to the sequential one.
+    // The state does not fully converge: the probabilities after the shard boundaries can differ from the sequential
+    // ones by up to ~0.1, regardless of the warm-up length. Use it when the latency matters more than exactness.
+    // The threads of the context are divided between the shards.
+    WHISPER_API bool whisper_vad_detect_speech_parallel(
+            struct whisper_vad_context * vctx,
+                           const float * samples,
+                                   int   n_samples,
+                                   int   n_shards,
+                                   int   warmup_ms);
+
     WHISPER_API int     whisper_vad_n_probs(struct whisper_vad_context * vctx);
     WHISPER_API float * whisper_vad_probs  (struct whisper_vad_context * vctx);
 
@@ -717,6 +814,45 @@ extern "C" {
     WHISPER_API void whisper_vad_free_segments(struct whisper_vad_segments * segments);
     WHISPER_API void whisper_vad_free         (struct whisper_vad_context  * ctx);
 
+    // Streaming VAD
+    // The audio is pushed in pieces of any size. The LSTM state and the segment detection are kept between the
+    // calls, so that the segments are reported while the audio is coming in:
+    //  - the start of a segment once the speech has lasted min_speech_duration_ms
+    //  - the end of a segment after min_silence_duration_ms of silence, or when max_speech_duration_s is reached
+    // The times include speech_pad_ms and are in centiseconds since the last reset. Unlike
+    // whisper_vad_segments_from_probs(), close segments are not merged.
+    // whisper_vad_detect_speech() resets the stream.
+
+    enum whisper_vad_event_type {
+        WHISPER_VAD_EVENT_SPEECH_START = 0,
+        WHISPER_VAD_EVENT_SPEECH_END   = 1,
+    };
+
+    struct whisper_vad_event {
+        enum whisper_vad_event_type type;
+        int64_t t; // centiseconds
+    };
+
+    WHISPER_API void whisper_vad_stream_reset(struct whisper_vad_context * vctx);
+
+    // returns the number of events produced by these samples, or -1 on failure
+    // after a failure, the samples stay pending and the LSTM state is restored, so the next call continues from them
+    WHISPER_API int whisper_vad_push_samples(
+            struct whisper_vad_context * vctx,
+            struct whisper_vad_params    params,
+                           const float * samples,
+                                   int   n_samples);
+
+    // end of the stream: processes the samples that do not fill a chunk and ends the current segment at the end
+    // of the audio. Call whisper_vad_stream_reset() before pushing a new stream
+    // returns the number of events, or -1 on failure
+    WHISPER_API int whisper_vad_flush(
+            struct whisper_vad_context * vctx,
+            struct whisper_vad_params    params);
+
+    // the events of the last whisper_vad_push_samples() or whisper_vad_flush() call
+    WHISPER_API const struct whisper_vad_event * whisper_vad_events(struct whisper_vad_context * vctx);
+
     ////////////////////////////////////////////////////////////////////////////
 
     // Temporary helpers needed for exposing ggml interface
@@ -725,6 +861,10 @@ extern "C" {
     WHISPER_API const char * whisper_bench_memcpy_str      (int n_threads);
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
+    WHISPER_API int          whisper_bench_fft             (int n_threads);
+    WHISPER_API const char * whisper_bench_fft_str         (int n_threads);
+    WHISPER_API int          whisper_bench_sampling        (int n_threads);
+    WHISPER_API const char * whisper_bench_sampling_str    (int n_threads);
 
     // Control logging output; default behavior is to print to stderr
 
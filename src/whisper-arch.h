@@ -170,7 +170,7 @@ static const std::map<vad_tensor, ggml_op> VAD_TENSOR_OPS = {
     {VAD_TENSOR_ENC_3_BIAS,          GGML_OP_ADD},
 
     {VAD_TENSOR_LSTM_WEIGHT_IH,      GGML_OP_MUL_MAT},
-    {VAD_TENSOR_LSTM_WEIGHT_HH,      GGML_OP_MUL_MAT},
+    {VAD_TENSOR_LSTM_WEIGHT_HH,      GGML_OP_NONE},    // read by the CPU LSTM step, not used in a graph
     {VAD_TENSOR_LSTM_BIAS_IH,        GGML_OP_ADD},
     {VAD_TENSOR_LSTM_BIAS_HH,        GGML_OP_ADD},
 
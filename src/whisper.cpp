@@ -17,17 +17,22 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cfloat>
 #define _USE_MATH_DEFINES
 #include <cmath>
+#include <chrono>
 #include <climits>
 #include <codecvt>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <regex>
@@ -36,6 +41,22 @@
 #include <thread>
 #include <vector>
 
+#ifdef __has_include
+    #if __has_include(<unistd.h>)
+        #include <unistd.h>
+        #if defined(_POSIX_MAPPED_FILES)
+            #include <sys/mman.h>
+            #include <sys/stat.h>
+            #include <fcntl.h>
+            #include <dirent.h>
+        #endif
+    #endif
+#endif
+
+#if defined(_POSIX_MAPPED_FILES) && !defined(WHISPER_BIG_ENDIAN)
+#define WHISPER_USE_MMAP 1
+#endif
+
 #if defined(WHISPER_BIG_ENDIAN)
 template<typename T>
 static T byteswap(T value) {
@@ -140,6 +161,9 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
 
+// [EXPERIMENTAL] adaptive audio context: audio context frames of silence kept after the end of the audio
+#define WHISPER_AUDIO_CTX_MARGIN 16
+
 static std::string format(const char * fmt, ...) {
     va_list ap;
     va_list ap2;
@@ -457,8 +481,62 @@ struct whisper_filters {
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // sparse layout of data, built at load time
+    // mel band j only covers the FFT bins [start[j], start[j] + len[j]) and its weights begin at weights[offs[j]]
+    std::vector<int32_t> start;
+    std::vector<int32_t> len;
+    std::vector<int32_t> offs;
+    std::vector<float>   weights;
+};
+
+// incrementally computed log mel spectrogram of an audio stream
+// ref: whisper_pcm_to_mel_append_with_state()
+struct whisper_mel_stream {
+    int64_t n_samples = 0; // samples appended since the last reset
+    int64_t n_final   = 0; // frames that no longer depend on future samples
+    int64_t n_drop    = 0; // final frames dropped from the front of the window
+
+    // false until enough samples arrived for the reflective pad at the start of the stream
+    bool has_pad = false;
+
+    // padded samples starting at the first frame that is not final yet
+    std::vector<float> pending;
+
+    // raw log10 values of the final frames in the window, [n_final - n_drop][n_mel]
+    std::vector<float> frames;
+
+    // decreasing maxima of the final frames in the window, as (frame index, max) - the front is the window maximum
+    std::deque<std::pair<int64_t, float>> mmax;
+
+    // samples in the window and their energy, used for token-level timestamps
+    std::vector<float> pcm;
+    std::vector<float> energy;
 };
 
+static void whisper_filters_init_sparse(whisper_filters & filters) {
+    filters.start.resize(filters.n_mel);
+    filters.len  .resize(filters.n_mel);
+    filters.offs .resize(filters.n_mel);
+    filters.weights.clear();
+
+    for (int j = 0; j < filters.n_mel; ++j) {
+        const float * row = filters.data.data() + j*filters.n_fft;
+
+        int k0 = 0;
+        int k1 = filters.n_fft;
+
+        while (k0 < k1 && row[k0]     == 0.0f) k0++;
+        while (k1 > k0 && row[k1 - 1] == 0.0f) k1--;
+
+        filters.start[j] = k0;
+        filters.len[j]   = k1 - k0;
+        filters.offs[j]  = filters.weights.size();
+
+        filters.weights.insert(filters.weights.end(), row + k0, row + k1);
+    }
+}
+
 struct whisper_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -722,24 +800,33 @@ struct whisper_layer_decoder {
     struct ggml_tensor * mlp_1_b;
 };
 
-struct whisper_kv_cell {
-    whisper_pos pos = -1;
+// the sequences of a KV cell are stored as a bitmask
+#define WHISPER_KV_MAX_SEQ 64
 
-    std::set<whisper_seq_id> seq_id;
+// sequences that keep the prefilled prompts of a window, see whisper_full_with_state()
+#define WHISPER_KV_SEQ_PROMPT (2*WHISPER_MAX_DECODERS)
+#define WHISPER_KV_N_PROMPT   2
 
-    bool has_seq_id(const whisper_seq_id & id) const {
-        return seq_id.find(id) != seq_id.end();
-    }
-};
+static_assert(WHISPER_KV_SEQ_PROMPT + WHISPER_KV_N_PROMPT <= WHISPER_KV_MAX_SEQ, "the sequence ids have to fit in the bitmask of the cells");
+
+static inline uint64_t whisper_kv_seq_bit(whisper_seq_id seq_id) {
+    WHISPER_ASSERT(seq_id >= 0 && seq_id < WHISPER_KV_MAX_SEQ);
+    return 1ull << seq_id;
+}
 
 struct whisper_kv_cache {
-    uint32_t head = 0;
+    uint32_t head = 0; // all the cells before it are in use
     uint32_t size = 0;
 
     // computed before each graph build
     uint32_t n = 0;
 
-    std::vector<whisper_kv_cell> cells;
+    // metadata of the cells
+    std::vector<whisper_pos> cells_pos; // -1 if the cell is empty
+    std::vector<uint64_t>    cells_seq; // bit s is set if the cell belongs to sequence s
+
+    // the cells of the tokens of the last batch, see whisper_kv_cache_find_slot()
+    std::vector<int64_t> slot;
 
     struct ggml_tensor * k;
     struct ggml_tensor * v;
@@ -749,6 +836,31 @@ struct whisper_kv_cache {
     std::vector<uint8_t> ctx_buf;
 };
 
+// read-only mapping of a model file
+// the weights of the CPU buffer point directly into the mapped pages, so the mapping has to outlive the model buffers
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+
+    // identity of the mapped file, used to fingerprint the weight arenas
+    std::string path;
+    uint64_t    dev      = 0;
+    uint64_t    ino      = 0;
+    int64_t     mtime_ns = 0;
+
+    whisper_mmap() = default;
+    whisper_mmap(const whisper_mmap &) = delete;
+    whisper_mmap & operator=(const whisper_mmap &) = delete;
+
+    ~whisper_mmap() {
+#ifdef WHISPER_USE_MMAP
+        if (addr) {
+            munmap(addr, size);
+        }
+#endif
+    }
+};
+
 struct whisper_model {
     e_model type = MODEL_UNKNOWN;
 
@@ -789,6 +901,9 @@ struct whisper_model {
     // the model backend data is read-only and can be shared between processors
     std::vector<ggml_backend_buffer_t> buffers;
 
+    // backing memory of the mapped CPU buffer (if any)
+    std::shared_ptr<whisper_mmap> mapping;
+
     // tensors
     int n_loaded;
     std::map<std::string, struct ggml_tensor *> tensors;
@@ -800,8 +915,9 @@ struct whisper_partial_utf8 {
 };
 
 struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
+    // shared by the copies of the grammar - the stacks point into it
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>> rules;
+    std::vector<std::vector<const whisper_grammar_element *>>                 stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8 partial_utf8;
@@ -827,6 +943,13 @@ struct whisper_sequence {
 };
 
 // TAGS: WHISPER_DECODER_INIT
+// computed by whisper_logits_softmax() for the sampling
+struct whisper_logits_stats {
+    int   id_max  = 0;    // the most probable token
+    int   tid_max = -1;   // the most probable timestamp token, -1 if all of them are suppressed
+    float ptsum   = 0.0f; // total probability of the timestamp tokens
+};
+
 struct whisper_decoder {
     // the currently generated sequence of tokens
     whisper_sequence sequence;
@@ -846,8 +969,12 @@ struct whisper_decoder {
     std::vector<float> logits;
     std::vector<float> logprobs;
 
-    // work container used to avoid memory allocations
+    // summary of probs, computed together with them
+    whisper_logits_stats stats;
+
+    // work containers used to avoid memory allocations
     std::vector<whisper_pair<double, whisper_vocab::id>> logits_id;
+    std::vector<double> probs_cum; // cumulative probs for drawing the beam candidates
 
     mutable std::mt19937 rng; // used for sampling at t > 0.0
 };
@@ -864,6 +991,100 @@ struct vad_time_mapping {
     int64_t original_time;   // Corresponding time in original audio
 };
 
+// persistent worker threads of a state, used for the sampling and the mel spectrogram
+// the threads are started on first use and sleep between the runs
+struct whisper_worker_pool {
+    std::vector<std::thread> threads;
+
+    std::mutex              mutex;
+    std::condition_variable cv_run;
+    std::condition_variable cv_done;
+
+    const std::function<void(int)> * fn = nullptr;
+
+    uint64_t run       = 0;     // incremented for each run
+    int      n_run     = 0;     // number of threads taking part in the current run
+    int      n_pending = 0;     // threads that have not finished the current run yet
+    bool     stop      = false;
+
+    whisper_worker_pool() = default;
+    whisper_worker_pool(const whisper_worker_pool &) = delete;
+    whisper_worker_pool & operator=(const whisper_worker_pool &) = delete;
+
+    ~whisper_worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv_run.notify_all();
+
+        for (auto & t : threads) {
+            t.join();
+        }
+    }
+};
+
+static void whisper_worker_pool_thread(whisper_worker_pool * pool, int ith) {
+    uint64_t run = 0;
+
+    while (true) {
+        const std::function<void(int)> * fn = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(pool->mutex);
+            pool->cv_run.wait(lock, [&] { return pool->stop || pool->run != run; });
+
+            if (pool->stop) {
+                return;
+            }
+
+            run = pool->run;
+
+            if (ith >= pool->n_run) {
+                continue;
+            }
+
+            fn = pool->fn;
+        }
+
+        (*fn)(ith + 1);
+
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if (--pool->n_pending == 0) {
+                pool->cv_done.notify_one();
+            }
+        }
+    }
+}
+
+// call fn(ith) for ith = 0 .. n_threads - 1 in parallel and wait for all of them
+// the calling thread runs ith = 0, the rest is run by the threads of the pool
+static void whisper_worker_pool_run(whisper_worker_pool & pool, int n_threads, const std::function<void(int)> & fn) {
+    if (n_threads <= 1) {
+        fn(0);
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        while ((int) pool.threads.size() < n_threads - 1) {
+            pool.threads.emplace_back(whisper_worker_pool_thread, &pool, (int) pool.threads.size());
+        }
+
+        pool.fn        = &fn;
+        pool.n_run     = n_threads - 1;
+        pool.n_pending = n_threads - 1;
+        pool.run++;
+    }
+    pool.cv_run.notify_all();
+
+    fn(0);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.cv_done.wait(lock, [&] { return pool.n_pending == 0; });
+}
+
 struct whisper_state {
     int64_t t_sample_us = 0;
     int64_t t_encode_us = 0;
@@ -871,6 +1092,7 @@ struct whisper_state {
     int64_t t_batchd_us = 0;
     int64_t t_prompt_us = 0;
     int64_t t_mel_us = 0;
+    int64_t t_draft_us = 0;
 
     int32_t n_sample = 0; // number of tokens sampled
     int32_t n_encode = 0; // number of encoder calls
@@ -879,9 +1101,8 @@ struct whisper_state {
     int32_t n_prompt = 0; // number of decoder calls with n_tokens >  1  (prompt encoding)
     int32_t n_fail_p = 0; // number of logprob threshold failures
     int32_t n_fail_h = 0; // number of entropy threshold failures
-
-    // number of decoders for which we have constructed the KV cache
-    int32_t kv_self_n_dec = 0;
+    int32_t n_drafted  = 0; // number of tokens proposed by the draft model
+    int32_t n_accepted = 0; // number of drafted tokens accepted by the main model
 
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
@@ -894,6 +1115,7 @@ struct whisper_state {
     whisper_kv_cache kv_pad;
 
     whisper_mel mel;
+    whisper_mel_stream mel_stream;
 
     whisper_batch batch;
 
@@ -912,8 +1134,10 @@ struct whisper_state {
     struct ggml_tensor * embd_enc  = nullptr;
 
     // helpers for GPU offloading
-    std::vector<float> inp_mel;
-    std::vector<float> inp_mask;
+    std::vector<float>   inp_mel;
+    std::vector<float>   inp_mask;
+    std::vector<int32_t> inp_seq_pos;
+    std::vector<int64_t> inp_v_idxs;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
@@ -921,6 +1145,15 @@ struct whisper_state {
     std::vector<whisper_segment> result_all;
     std::vector<whisper_token>   prompt_past;
 
+    // tokens that are always suppressed during sampling - one bit per vocab entry
+    // cached for the params it was built for, see whisper_suppress_mask_update()
+    std::vector<uint64_t> suppress_mask;
+    std::string           suppress_mask_regex;
+    bool                  suppress_mask_nst   = false;
+    bool                  suppress_mask_tdrz  = false;
+    bool                  suppress_mask_no_ts = false;
+    bool                  suppress_mask_valid = false;
+
     int lang_id = 0; // english by default
 
     std::string path_model; // populated by whisper_init_from_file_with_params()
@@ -950,6 +1183,11 @@ struct whisper_state {
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
 
+    // the window for which the cross-attention KV cache has been computed: the mel offset and exp_n_audio_ctx
+    // reset when the mel spectrogram changes
+    int32_t enc_mel_offset = -1;
+    int32_t enc_n_ctx      =  0;
+
     whisper_vad_context * vad_context = nullptr;
 
     struct vad_segment_info {
@@ -962,6 +1200,18 @@ struct whisper_state {
     bool has_vad_segments = false;
 
     std::vector<vad_time_mapping> vad_mapping_table;
+
+    // the speech segments [t0, t1) in centiseconds of the original audio for params.vad_seek
+    std::vector<std::pair<int, int>> vad_seek_segments;
+
+    // shares the text-generation steps with other states (optional)
+    whisper_batcher * batcher = nullptr;
+
+    // the state of the draft model for speculative decoding, created by whisper_full() on first use
+    whisper_context * draft_ctx = nullptr;
+    whisper_state   * draft     = nullptr;
+
+    whisper_worker_pool workers;
 };
 
 struct whisper_context {
@@ -978,6 +1228,9 @@ struct whisper_context {
 
     whisper_state * state = nullptr;
 
+    // additional states reused by whisper_full_parallel()
+    std::vector<whisper_state *> states_pool;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
 };
 
@@ -1016,8 +1269,8 @@ static bool whisper_kv_cache_init(
     cache.head = 0;
     cache.size = n_ctx;
 
-    cache.cells.clear();
-    cache.cells.resize(n_ctx);
+    cache.cells_pos.assign(n_ctx, -1);
+    cache.cells_seq.assign(n_ctx, 0);
 
     struct ggml_context * ctx = ggml_init(params);
 
@@ -1057,50 +1310,39 @@ static bool whisper_kv_cache_find_slot(
         return false;
     }
 
-    uint32_t n_tested = 0;
-
-    while (true) {
-        if (cache.head + n_tokens > n_ctx) {
-            n_tested += n_ctx - cache.head;
-            cache.head = 0;
-            continue;
-        }
-
-        bool found = true;
-        for (uint32_t i = 0; i < n_tokens; i++) {
-            if (cache.cells[cache.head + i].pos >= 0) {
-                found = false;
-                cache.head += i + 1;
-                n_tested   += i + 1;
-                break;
-            }
-        }
-
-        if (found) {
-            break;
+    // the cells of a batch do not have to be contiguous - the new K and V rows are scattered to them by the graph
+    // taking the free cells in order keeps the used cells packed at the start of the cache
+    cache.slot.clear();
+    for (uint32_t i = cache.head; i < n_ctx && cache.slot.size() < n_tokens; ++i) {
+        if (cache.cells_pos[i] < 0) {
+            cache.slot.push_back(i);
         }
+    }
 
-        if (n_tested >= n_ctx) {
-            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
-        }
+    if (cache.slot.size() < n_tokens) {
+        //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+        return false;
     }
 
     for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+        const int64_t ic = cache.slot[i];
+
+        cache.cells_pos[ic] = batch.pos[i];
 
         for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
+            cache.cells_seq[ic] |= whisper_kv_seq_bit(batch.seq_id[i][j]);
         }
     }
 
+    cache.head = cache.slot.back() + 1;
+
     return true;
 }
 
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
     for (uint32_t i = cache.size - 1; i > 0; --i) {
-        if (cache.cells[i].pos >= 0 && !cache.cells[i].seq_id.empty()) {
+        if (cache.cells_pos[i] >= 0 && cache.cells_seq[i] != 0) {
             return i + 1;
         }
     }
@@ -1109,10 +1351,8 @@ static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache)
 }
 
 static void whisper_kv_cache_clear(struct whisper_kv_cache & cache) {
-    for (int32_t i = 0; i < (int32_t) cache.size; ++i) {
-        cache.cells[i].pos = -1;
-        cache.cells[i].seq_id.clear();
-    }
+    std::fill(cache.cells_pos.begin(), cache.cells_pos.end(), -1);
+    std::fill(cache.cells_seq.begin(), cache.cells_seq.end(), 0);
     cache.head = 0;
 
     ggml_backend_buffer_clear(cache.buffer, 0);
@@ -1128,24 +1368,40 @@ static void whisper_kv_cache_seq_rm(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
+    const uint64_t keep = seq_id < 0 ? 0 : ~whisper_kv_seq_bit(seq_id);
+
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            if (seq_id < 0) {
-                cache.cells[i].seq_id.clear();
-            } else if (cache.cells[i].has_seq_id(seq_id)) {
-                cache.cells[i].seq_id.erase(seq_id);
-            } else {
+        if (cache.cells_pos[i] >= p0 && cache.cells_pos[i] < p1) {
+            if ((cache.cells_seq[i] & ~keep) == 0) {
                 continue;
             }
-            if (cache.cells[i].seq_id.empty()) {
-                cache.cells[i].pos = -1;
+            cache.cells_seq[i] &= keep;
+            if (cache.cells_seq[i] == 0) {
+                cache.cells_pos[i] = -1;
                 if (new_head == cache.size) new_head = i;
             }
         }
     }
 
     // If we freed up a slot, set head to it so searching can start there.
-    if (new_head != cache.size) cache.head = new_head;
+    if (new_head != cache.size) cache.head = std::min(cache.head, new_head);
+}
+
+// remove all the sequences that are not in the keep mask
+static void whisper_kv_cache_seq_keep(
+        struct whisper_kv_cache & cache,
+                       uint64_t   keep) {
+    uint32_t new_head = cache.size;
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        cache.cells_seq[i] &= keep;
+        if (cache.cells_seq[i] == 0 && cache.cells_pos[i] >= 0) {
+            cache.cells_pos[i] = -1;
+            if (new_head == cache.size) new_head = i;
+        }
+    }
+
+    if (new_head != cache.size) cache.head = std::min(cache.head, new_head);
 }
 
 static void whisper_kv_cache_seq_cp(
@@ -1157,12 +1413,12 @@ static void whisper_kv_cache_seq_cp(
     if (p0 < 0) p0 = 0;
     if (p1 < 0) p1 = std::numeric_limits<whisper_pos>::max();
 
-    cache.head = 0;
+    const uint64_t bit_src = whisper_kv_seq_bit(seq_id_src);
+    const uint64_t bit_dst = whisper_kv_seq_bit(seq_id_dst);
 
     for (uint32_t i = 0; i < cache.size; ++i) {
-        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
-            cache.cells[i].seq_id.insert(seq_id_dst);
-        }
+        const bool cp = (cache.cells_seq[i] & bit_src) && cache.cells_pos[i] >= p0 && cache.cells_pos[i] < p1;
+        cache.cells_seq[i] |= cp ? bit_dst : 0;
     }
 }
 
@@ -1496,6 +1752,355 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
+// map a model file into memory - returns nullptr if mapping is not supported or failed
+static std::shared_ptr<whisper_mmap> whisper_mmap_open(const char * path, bool prefetch) {
+#ifdef WHISPER_USE_MMAP
+    const int fd = ::open(path, O_RDONLY);
+    if (fd == -1) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    const size_t size = st.st_size;
+
+    int flags = MAP_SHARED;
+#ifdef __linux__
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL)) {
+        WHISPER_LOG_WARN("%s: posix_fadvise(.., POSIX_FADV_SEQUENTIAL) failed: %s\n", __func__, strerror(errno));
+    }
+    if (prefetch) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+
+    void * addr = mmap(NULL, size, PROT_READ, flags, fd, 0);
+    ::close(fd);
+
+    if (addr == MAP_FAILED) {
+        WHISPER_LOG_WARN("%s: mmap failed: %s\n", __func__, strerror(errno));
+        return nullptr;
+    }
+
+    if (prefetch && posix_madvise(addr, size, POSIX_MADV_WILLNEED)) {
+        WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+    }
+
+    auto mapping = std::make_shared<whisper_mmap>();
+    mapping->addr = addr;
+    mapping->size = size;
+
+    char path_real[PATH_MAX];
+    mapping->path     = realpath(path, path_real) ? path_real : path;
+    mapping->dev      = st.st_dev;
+    mapping->ino      = st.st_ino;
+    mapping->mtime_ns = (int64_t) st.st_mtime*1000000000;
+#ifdef __linux__
+    mapping->mtime_ns += st.st_mtim.tv_nsec;
+#endif
+
+    return mapping;
+#else
+    GGML_UNUSED(path);
+    GGML_UNUSED(prefetch);
+
+    return nullptr;
+#endif
+}
+
+struct whisper_mmap_reader {
+    std::shared_ptr<whisper_mmap> mapping;
+
+    size_t pos = 0;
+};
+
+static size_t whisper_mmap_reader_read(void * ctx, void * output, size_t read_size) {
+    whisper_mmap_reader * reader = (whisper_mmap_reader *) ctx;
+
+    const size_t n = std::min(read_size, reader->mapping->size - reader->pos);
+
+    memcpy(output, (const char *) reader->mapping->addr + reader->pos, n);
+    reader->pos += n;
+
+    return n;
+}
+
+static bool whisper_mmap_reader_eof(void * ctx) {
+    whisper_mmap_reader * reader = (whisper_mmap_reader *) ctx;
+
+    return reader->pos >= reader->mapping->size;
+}
+
+// location of the data of a tensor record in a mapped model file
+struct whisper_mmap_tensor {
+    size_t    offs;
+    size_t    nbytes;
+    ggml_type type;
+};
+
+// walk the tensor records that follow the vocab, without touching the tensor data
+static void whisper_mmap_scan_tensors(const whisper_mmap & mapping, size_t pos, std::map<std::string, whisper_mmap_tensor> & result) {
+    const char * base = (const char *) mapping.addr;
+
+    while (pos + 3*sizeof(int32_t) <= mapping.size) {
+        int32_t hdr[3]; // n_dims, length, ttype
+        memcpy(hdr, base + pos, sizeof(hdr));
+        pos += sizeof(hdr);
+
+        const int32_t n_dims = hdr[0];
+        const int32_t length = hdr[1];
+        const int32_t ttype  = hdr[2];
+
+        if (n_dims < 0 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            return;
+        }
+
+        if (ggml_blck_size(ggml_type(ttype)) == 0 || pos + n_dims*sizeof(int32_t) + length > mapping.size) {
+            return;
+        }
+
+        int64_t nelements = 1;
+        for (int i = 0; i < n_dims; ++i) {
+            int32_t ne;
+            memcpy(&ne, base + pos, sizeof(ne));
+            pos += sizeof(ne);
+
+            if (ne < 0) {
+                return;
+            }
+            nelements *= ne;
+        }
+
+        std::string name(base + pos, length);
+        pos += length;
+
+        const size_t nbytes = (nelements*ggml_type_size(ggml_type(ttype)))/ggml_blck_size(ggml_type(ttype));
+        if (pos + nbytes > mapping.size) {
+            return;
+        }
+
+        result[name] = { pos, nbytes, ggml_type(ttype) };
+        pos += nbytes;
+    }
+}
+
+// the ggml file format has no padding, so the tensor data can only be used in place
+// if its offset satisfies the alignment of the elements that the CPU kernels load
+static bool whisper_mmap_offs_ok(size_t offs, ggml_type type) {
+    const size_t type_size = ggml_type_size(type);
+    const size_t align = type_size % 4 == 0 ? 4 : type_size % 2 == 0 ? 2 : 1;
+
+    return offs % align == 0;
+}
+
+// a weight arena is a read-only copy of the tensor data of a model file, with every tensor aligned
+// it lives in a shared directory (e.g. /dev/shm) and is keyed by a fingerprint of the model file,
+// so all processes loading the same model map the same physical pages
+// when the model file changes, the next loader creates a new arena and removes the ones of the previous
+// version of the file - the processes still using them keep their mapping until they exit
+#define WHISPER_ARENA_MAGIC   0x77617261 // "wara"
+#define WHISPER_ARENA_VERSION 2
+#define WHISPER_ARENA_ALIGN   64
+
+struct whisper_arena_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;
+    uint64_t source; // hash of the path of the model file
+    uint64_t size;
+    uint64_t n_tensors;
+};
+
+static uint64_t whisper_fnv1a(uint64_t hash, const void * data, size_t size) {
+    const uint8_t * p = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool whisper_arena_valid(const whisper_mmap & arena, uint64_t hash, size_t size, size_t n_tensors) {
+    if (arena.size != size) {
+        return false;
+    }
+
+    whisper_arena_header hdr;
+    memcpy(&hdr, arena.addr, sizeof(hdr));
+
+    return hdr.magic == WHISPER_ARENA_MAGIC && hdr.version == WHISPER_ARENA_VERSION &&
+           hdr.hash == hash && hdr.size == size && hdr.n_tensors == n_tensors;
+}
+
+#ifdef WHISPER_USE_MMAP
+// remove the arenas created for previous versions of the same model file
+static void whisper_arena_remove_stale(const char * dir, const std::string & path_keep, uint64_t source) {
+    DIR * d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    while (struct dirent * e = readdir(d)) {
+        const std::string name = e->d_name;
+        if (name.compare(0, 8, "whisper-") != 0 || name.size() < 14 || name.compare(name.size() - 6, 6, ".arena") != 0) {
+            continue;
+        }
+
+        const std::string path = format("%s/%s", dir, name.c_str());
+        if (path == path_keep) {
+            continue;
+        }
+
+        whisper_arena_header hdr;
+
+        FILE * fin = fopen(path.c_str(), "rb");
+        if (!fin) {
+            continue;
+        }
+        const bool ok = fread(&hdr, sizeof(hdr), 1, fin) == 1;
+        fclose(fin);
+
+        if (ok && hdr.magic == WHISPER_ARENA_MAGIC && hdr.version == WHISPER_ARENA_VERSION && hdr.source == source) {
+            if (remove(path.c_str()) == 0) {
+                WHISPER_LOG_INFO("%s: removed stale weight arena '%s'\n", __func__, path.c_str());
+            }
+        }
+    }
+
+    closedir(d);
+}
+#endif
+
+// map the arena for the model file, creating it first if it does not exist yet
+// on success, records_arena holds the location of each tensor inside the arena
+static std::shared_ptr<whisper_mmap> whisper_arena_attach(
+        const char * dir,
+        const whisper_mmap & file,
+        size_t data_pos,
+        const std::map<std::string, ggml_tensor *> & tensors,
+        const std::map<std::string, whisper_mmap_tensor> & records,
+        bool prefetch,
+        std::map<std::string, whisper_mmap_tensor> & records_arena) {
+#ifdef WHISPER_USE_MMAP
+    // the fingerprint covers the identity of the file (device, inode, size, modification time), the hparams,
+    // filters and vocab, the tensor records and a sample of each tensor's data
+    // this avoids reading the whole file on every start - a file rewritten in place gets a new modification time
+    const uint64_t source = whisper_fnv1a(0xcbf29ce484222325ULL, file.path.data(), file.path.size());
+
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = whisper_fnv1a(hash, &file.dev,      sizeof(file.dev));
+    hash = whisper_fnv1a(hash, &file.ino,      sizeof(file.ino));
+    hash = whisper_fnv1a(hash, &file.size,     sizeof(file.size));
+    hash = whisper_fnv1a(hash, &file.mtime_ns, sizeof(file.mtime_ns));
+    hash = whisper_fnv1a(hash, file.addr, data_pos);
+
+    size_t size = GGML_PAD(sizeof(whisper_arena_header), WHISPER_ARENA_ALIGN);
+
+    for (const auto & p : tensors) {
+        const auto it = records.find(p.first);
+        if (it == records.end() || it->second.type != p.second->type || it->second.nbytes != ggml_nbytes(p.second)) {
+            WHISPER_LOG_WARN("%s: tensor '%s' does not match the model file - not using a weight arena\n", __func__, p.first.c_str());
+            return nullptr;
+        }
+
+        const whisper_mmap_tensor & rec = it->second;
+        const char * data = (const char *) file.addr + rec.offs;
+        const size_t n_sample = std::min<size_t>(rec.nbytes, 256);
+
+        hash = whisper_fnv1a(hash, p.first.data(), p.first.size());
+        hash = whisper_fnv1a(hash, &rec.type, sizeof(rec.type));
+        hash = whisper_fnv1a(hash, &rec.nbytes, sizeof(rec.nbytes));
+        hash = whisper_fnv1a(hash, data, n_sample);
+        hash = whisper_fnv1a(hash, data + rec.nbytes - n_sample, n_sample);
+
+        records_arena[p.first] = { size, rec.nbytes, rec.type };
+
+        size = GGML_PAD(size + rec.nbytes, WHISPER_ARENA_ALIGN);
+    }
+
+    const std::string path = format("%s/whisper-%016llx.arena", dir, (unsigned long long) hash);
+
+    // contexts of the same process share a single mapping
+    static std::mutex mutex;
+    static std::map<std::string, std::weak_ptr<whisper_mmap>> attached;
+
+    std::lock_guard<std::mutex> lock(mutex);
+
+    std::shared_ptr<whisper_mmap> arena = attached[path].lock();
+    if (arena) {
+        return arena;
+    }
+
+    arena = whisper_mmap_open(path.c_str(), prefetch);
+    if (arena && whisper_arena_valid(*arena, hash, size, tensors.size())) {
+        WHISPER_LOG_INFO("%s: attached to weight arena '%s'\n", __func__, path.c_str());
+        attached[path] = arena;
+        return arena;
+    }
+    arena.reset();
+
+    // write to a private file first and rename it in place, so that concurrent loaders never see a partial arena
+    const std::string path_tmp = format("%s.tmp.%d", path.c_str(), (int) getpid());
+
+    FILE * fout = fopen(path_tmp.c_str(), "wb");
+    if (!fout) {
+        WHISPER_LOG_WARN("%s: failed to create weight arena '%s': %s\n", __func__, path_tmp.c_str(), strerror(errno));
+        return nullptr;
+    }
+
+    const whisper_arena_header hdr = { WHISPER_ARENA_MAGIC, WHISPER_ARENA_VERSION, hash, source, size, tensors.size() };
+    const char zeros[WHISPER_ARENA_ALIGN] = { 0 };
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, fout) == 1;
+    size_t pos = sizeof(hdr);
+
+    for (const auto & p : tensors) {
+        const whisper_mmap_tensor & dst = records_arena.at(p.first);
+        const whisper_mmap_tensor & src = records.at(p.first);
+
+        ok = ok && fwrite(zeros, 1, dst.offs - pos, fout) == dst.offs - pos;
+        ok = ok && fwrite((const char *) file.addr + src.offs, 1, src.nbytes, fout) == src.nbytes;
+        pos = dst.offs + dst.nbytes;
+    }
+    ok = ok && fwrite(zeros, 1, size - pos, fout) == size - pos;
+    ok = fclose(fout) == 0 && ok;
+
+    if (!ok || rename(path_tmp.c_str(), path.c_str()) != 0) {
+        WHISPER_LOG_WARN("%s: failed to write weight arena '%s'\n", __func__, path.c_str());
+        remove(path_tmp.c_str());
+        return nullptr;
+    }
+
+    arena = whisper_mmap_open(path.c_str(), prefetch);
+    if (!arena || !whisper_arena_valid(*arena, hash, size, tensors.size())) {
+        WHISPER_LOG_WARN("%s: failed to map weight arena '%s'\n", __func__, path.c_str());
+        return nullptr;
+    }
+
+    WHISPER_LOG_INFO("%s: created weight arena '%s' (%.2f MB)\n", __func__, path.c_str(), size / 1e6);
+
+    whisper_arena_remove_stale(dir, path, source);
+
+    attached[path] = arena;
+
+    return arena;
+#else
+    GGML_UNUSED(dir);
+    GGML_UNUSED(file);
+    GGML_UNUSED(data_pos);
+    GGML_UNUSED(tensors);
+    GGML_UNUSED(records);
+    GGML_UNUSED(prefetch);
+    GGML_UNUSED(records_arena);
+
+    return nullptr;
+#endif
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1608,6 +2213,8 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         filters.data.resize(filters.n_mel * filters.n_fft);
         loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
         BYTESWAP_FILTERS(filters);
+
+        whisper_filters_init_sparse(filters);
     }
 
     // load vocab
@@ -1870,11 +2477,72 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_free(ctx);
     }
 
-    // allocate tensors in the backend buffers
-    for (auto & p : ctx_map) {
-        ggml_backend_buffer_type_t buft = p.first;
-        ggml_context * ctx = p.second;
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+    // when the file is mapped, point the CPU weights directly at the file data (or at a shared arena)
+    ggml_backend_buffer_t buf_mapped = nullptr;
+
+    if (loader->read == whisper_mmap_reader_read && ctx_map.count(ggml_backend_cpu_buffer_type())) {
+        whisper_mmap_reader * reader = (whisper_mmap_reader *) loader->context;
+
+        std::map<std::string, whisper_mmap_tensor> records;
+        whisper_mmap_scan_tensors(*reader->mapping, reader->pos, records);
+
+        std::shared_ptr<whisper_mmap> mapping = reader->mapping;
+
+        // prefer the shared, aligned copy of the weights if an arena directory is configured
+        if (wctx.params.weight_arena_dir) {
+            std::map<std::string, whisper_mmap_tensor> records_arena;
+
+            auto arena = whisper_arena_attach(wctx.params.weight_arena_dir, *reader->mapping, reader->pos,
+                    model.tensors, records, wctx.params.mmap_prefetch, records_arena);
+            if (arena) {
+                mapping = arena;
+                records.swap(records_arena);
+            }
+        }
+
+        std::set<ggml_tensor *> tensors_cpu;
+        {
+            ggml_context * ctx = ctx_map.at(ggml_backend_cpu_buffer_type());
+            for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+                tensors_cpu.insert(t);
+            }
+        }
+
+        size_t size_mapped = 0;
+
+        for (auto & p : model.tensors) {
+            ggml_tensor * tensor = p.second;
+
+            const auto it = records.find(p.first);
+            if (tensors_cpu.count(tensor) == 0 || it == records.end()) {
+                continue;
+            }
+
+            const whisper_mmap_tensor & rec = it->second;
+            if (rec.type != tensor->type || rec.nbytes != ggml_nbytes(tensor) || !whisper_mmap_offs_ok(rec.offs, rec.type)) {
+                continue;
+            }
+
+            if (buf_mapped == nullptr) {
+                buf_mapped = ggml_backend_cpu_buffer_from_ptr(mapping->addr, mapping->size);
+                model.buffers.emplace_back(buf_mapped);
+                model.mapping = mapping;
+            }
+
+            ggml_backend_tensor_alloc(buf_mapped, tensor, (char *) mapping->addr + rec.offs);
+            size_mapped += rec.nbytes;
+        }
+
+        if (buf_mapped) {
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf_mapped), size_mapped / 1e6);
+        }
+    }
+
+    // allocate tensors in the backend buffers (mapped tensors are skipped)
+    for (auto & p : ctx_map) {
+        ggml_backend_buffer_type_t buft = p.first;
+        ggml_context * ctx = p.second;
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
         if (buf) {
             model.buffers.emplace_back(buf);
 
@@ -1944,7 +2612,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
                 return false;
             }
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
+            if (tensor->buffer == buf_mapped) {
+                // the tensor already points at its data in the mapped file
+                ((whisper_mmap_reader *) loader->context)->pos += ggml_nbytes(tensor);
+            } else if (ggml_backend_buffer_is_host(tensor->buffer)) {
                 // for the CPU and Metal backend, we can read directly into the tensor
                 loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
                 BYTESWAP_TENSOR(tensor);
@@ -2060,63 +2731,31 @@ static struct ggml_cgraph * whisper_build_graph_conv(
     return gf;
 }
 
-static struct ggml_cgraph * whisper_build_graph_encoder(
-        whisper_context & wctx,
-          whisper_state & wstate) {
+// transformer layers of the encoder for n_batch windows of n_ctx frames each
+//   cur:    [n_state, n_ctx*n_batch] - embeddings including the positional encoding
+//   kv_pad: padded K/V buffer used by flash attention for a single window (nullptr to pad within the graph)
+static struct ggml_tensor * whisper_build_encoder_layers(
+         whisper_context & wctx,
+    struct ggml_context  * ctx0,
+     struct ggml_cgraph  * gf,
+      struct ggml_tensor * cur,
+                     int   n_ctx,
+                     int   n_batch,
+  const whisper_kv_cache * kv_pad) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_ctx   = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
     const int n_state = hparams.n_audio_state;
     const int n_head  = hparams.n_audio_head;
     const int n_layer = hparams.n_audio_layer;
 
     const int n_state_head = n_state/n_head;
 
-    auto & kv_pad = wstate.kv_pad;
-
-    WHISPER_ASSERT(!!kv_pad.buffer);
-
     const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
-        /*.no_alloc   =*/ true,
-    };
-
-    struct ggml_context * ctx0 = ggml_init(params);
-
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
-
-    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
-
     const float KQscale = 1.0f/sqrtf(float(n_state_head));
 
-    // ===================================================================
-    // NOTE: experimenting with partial evaluation of the encoder (ignore)
-    //static int iter = -1;
-    //const int n_iter = 1500/n_ctx;
-
-    //iter = (iter + 1) % n_iter;
-
-    //if (iter == 0) {
-    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
-    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
-    //}
-
-    static int iter = 0;
-
-    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
-    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
-
-    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
-
-    // ===================================================================
-
-    // original:
-    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+    GGML_ASSERT(kv_pad == nullptr || n_batch == 1);
 
     struct ggml_tensor * inpL = cur;
 
@@ -2160,35 +2799,51 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_ctx),
+                        ggml_reshape_4d(ctx0, Qcur, n_state_head, n_head, n_ctx, n_batch),
                         0, 2, 1, 3);
 
             if (wctx.params.flash_attn) {
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
+                struct ggml_tensor * K;
+                struct ggml_tensor * V;
 
-                struct ggml_tensor * K =
-                    ggml_view_3d(ctx0, kv_pad.k,
+                if (kv_pad) {
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad->k, n_ctx*n_state, 0)));
+                    ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad->v, n_ctx*n_state, 0)));
+
+                    K = ggml_view_3d(ctx0, kv_pad->k,
                             n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.k)*n_state,
-                            ggml_element_size(kv_pad.k)*n_state_head,
+                            ggml_element_size(kv_pad->k)*n_state,
+                            ggml_element_size(kv_pad->k)*n_state_head,
                             0);
 
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_pad.v,
+                    V = ggml_view_3d(ctx0, kv_pad->v,
                             n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.v)*n_state,
-                            ggml_element_size(kv_pad.v)*n_state_head,
+                            ggml_element_size(kv_pad->v)*n_state,
+                            ggml_element_size(kv_pad->v)*n_state_head,
                             0);
+                } else {
+                    // same zero padding as the kv_pad buffer, per window
+                    K = ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_pad(ctx0, ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_batch), 0, 0, n_ctx_pad - n_ctx, 0),
+                                wctx.itype),
+                            0, 2, 1, 3);
+
+                    V = ggml_permute(ctx0,
+                            ggml_cast(ctx0,
+                                ggml_pad(ctx0, ggml_reshape_4d(ctx0, Vcur, n_state_head, n_head, n_ctx, n_batch), 0, 0, n_ctx_pad - n_ctx, 0),
+                                wctx.itype),
+                            0, 2, 1, 3);
+                }
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx);
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
             } else {
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cast(ctx0,
-                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_batch),
                                 wctx.itype),
                             0, 2, 1, 3);
 
@@ -2200,9 +2855,9 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 struct ggml_tensor * V =
                     ggml_cast(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state_head, n_head, n_ctx),
+                                    n_state_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
                             wctx.itype);
 
@@ -2210,7 +2865,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx);
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx*n_batch);
             }
         }
 
@@ -2273,6 +2928,60 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 model.e_ln_b);
     }
 
+    return cur;
+}
+
+static struct ggml_cgraph * whisper_build_graph_encoder(
+        whisper_context & wctx,
+          whisper_state & wstate) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
+
+    auto & kv_pad = wstate.kv_pad;
+
+    WHISPER_ASSERT(!!kv_pad.buffer);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ wstate.sched_encode.meta.size(),
+        /*.mem_buffer =*/ wstate.sched_encode.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+
+    struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_conv);
+
+    // ===================================================================
+    // NOTE: experimenting with partial evaluation of the encoder (ignore)
+    //static int iter = -1;
+    //const int n_iter = 1500/n_ctx;
+
+    //iter = (iter + 1) % n_iter;
+
+    //if (iter == 0) {
+    //    memset(model.memory_cross_k->data, 0, ggml_nbytes(model.memory_cross_k));
+    //    memset(model.memory_cross_v->data, 0, ggml_nbytes(model.memory_cross_v));
+    //}
+
+    static int iter = 0;
+
+    const size_t e_pe_stride = model.e_pe->ne[0]*ggml_element_size(model.e_pe);
+    const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
+
+    struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
+    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+
+    // ===================================================================
+
+    // original:
+    //cur = ggml_add(ctx0, model.e_pe, ggml_transpose(ctx0, cur));
+
+    cur = whisper_build_encoder_layers(wctx, ctx0, gf, cur, n_ctx, 1, &kv_pad);
+
     ggml_build_forward_expand(gf, cur);
 
     wstate.embd_enc = cur;
@@ -2477,188 +3186,502 @@ static bool whisper_encode_internal(
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
+    wstate.enc_mel_offset = mel_offset;
+    wstate.enc_n_ctx      = wstate.exp_n_audio_ctx;
+
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-static struct ggml_cgraph * whisper_build_graph_decoder(
-         whisper_context & wctx,
-         whisper_state   & wstate,
-     const whisper_batch & batch,
-                    bool   save_alignment_heads_QKs,
-                    bool   worst_case) {
-    const auto & model   = wctx.model;
-    const auto & hparams = model.hparams;
+// true if the cross-attention KV cache of the state already holds the encoded window at mel_offset
+static bool whisper_encode_cached(const whisper_state & wstate, int mel_offset) {
+    return wstate.enc_mel_offset == mel_offset && wstate.enc_n_ctx == wstate.exp_n_audio_ctx;
+}
 
-    auto & kv_self = wstate.kv_self;
+// the copies of the cross-attention memory add a few nodes per window and text layer
+static int whisper_encode_batch_graph_size(const whisper_hparams & hparams, int n_batch) {
+    return WHISPER_MAX_NODES + 8*hparams.n_text_layer*n_batch;
+}
 
-    WHISPER_ASSERT(!!kv_self.buffer);
+// conv + encoder + cross-attention memory for several windows in a single graph
+// the windows are stacked along the batch dimension, so the matmuls of all windows run as one GEMM
+// window i reads inp_mel[i] and writes the cross-attention KV cache of states[i]
+static struct ggml_cgraph * whisper_build_graph_encoder_batch(
+                     whisper_context & wctx,
+                       whisper_sched & sched,
+    const std::vector<whisper_state *> & states,
+                                 int   n_ctx,
+                                 int   graph_size) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
 
-    const int n_ctx   = kv_self.size;
-    const int n_state = hparams.n_text_state;
-    const int n_head  = hparams.n_text_head;
-    const int n_layer = hparams.n_text_layer;
+    const int n_batch = states.size();
+    const int n_state = hparams.n_audio_state;
+    const int n_head  = hparams.n_audio_head;
+    const int n_mels  = hparams.n_mels;
 
     const int n_state_head = n_state/n_head;
 
-    const int n_tokens    = batch.n_tokens;
-    const int n_audio_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : hparams.n_audio_ctx;
-
-    const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
-
-    const int32_t n_kv    = worst_case ? n_ctx            : kv_self.n;
-    const int32_t kv_head = worst_case ? n_ctx - n_tokens : kv_self.head;
-
-    //WHISPER_LOG_DEBUG("%s: n_past = %d, n_tokens = %d, n_audio_ctx = %d, n_ctx = %d\n", __func__, n_past, n_tokens, n_audio_ctx, n_ctx);
+    const int n_ctx_pad = GGML_PAD(n_ctx, 256);
 
     struct ggml_init_params params = {
-        /*.mem_size   =*/ wstate.sched_decode.meta.size(),
-        /*.mem_buffer =*/ wstate.sched_decode.meta.data(),
+        /*.mem_size   =*/ sched.meta.size(),
+        /*.mem_buffer =*/ sched.meta.data(),
         /*.no_alloc   =*/ true,
     };
 
     struct ggml_context * ctx0 = ggml_init(params);
 
-    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, graph_size, false);
 
-    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(embd, "embd");
-    ggml_set_input(embd);
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
+    ggml_set_name(mel, "mel");
+    ggml_set_input(mel);
 
-    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
-    ggml_set_name(position, "position");
-    ggml_set_input(position);
+    // note: for batched input, the result of ggml_conv_1d is laid out as [OL, N, OC] - reorder it to [OL, OC, N]
+    auto conv_1d_ph = [&](struct ggml_tensor * w, struct ggml_tensor * x, int s) -> ggml_tensor * {
+        struct ggml_tensor * res = ggml_conv_1d_ph(ctx0, w, x, s, 1);
 
-    const float KQscale = pow(float(n_state_head), -0.25);
+        res = ggml_reshape_3d(ctx0, res, res->ne[0], n_batch, res->ne[1]);
 
-    struct ggml_tensor * KQ_mask = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_kv, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD), 1);
-    ggml_set_name(KQ_mask, "KQ_mask");
-    ggml_set_input(KQ_mask);
+        return ggml_cont(ctx0, ggml_permute(ctx0, res, 0, 2, 1, 3));
+    };
 
-    struct ggml_tensor * KQ_mask_f16 = ggml_cast(ctx0, KQ_mask, GGML_TYPE_F16);
+    struct ggml_tensor * cur = nullptr;
 
-    // token encoding + position encoding
-    struct ggml_tensor * cur =
-        ggml_add(ctx0,
-                ggml_get_rows(ctx0, model.d_te, embd),
-                ggml_get_rows(ctx0, model.d_pe, position));
+    // convolution + gelu
+    {
+        cur = conv_1d_ph(model.e_conv_1_w, mel, 1);
+        cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
-    struct ggml_tensor * inpL = cur;
+        cur = ggml_gelu(ctx0, cur);
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    struct ggml_tensor * aheads_cross_QKs = nullptr;
+        cur = conv_1d_ph(model.e_conv_2_w, cur, 2);
+        cur = ggml_add(ctx0, cur, model.e_conv_2_b);
 
-    for (int il = 0; il < n_layer; ++il) {
-        const auto & layer = model.layers_decoder[il];
+        cur = ggml_gelu(ctx0, cur);
+    }
 
-        // norm
-        {
-            cur = ggml_norm(ctx0, inpL, hparams.eps);
+    // [n_ctx, n_state, n_batch] -> [n_state, n_ctx*n_batch]
+    {
+        struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, model.e_pe->nb[1], 0);
 
-            // cur = ln_0_w*cur + ln_0_b
-            cur = ggml_add(ctx0,
-                    ggml_mul(ctx0,
-                        cur,
-                        layer.attn_ln_0_w),
-                    layer.attn_ln_0_b);
-        }
+        cur = ggml_add(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, cur)), e_pe);
+        cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
+    }
 
-        // self-attention
-        {
-            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
-                    layer.attn_q_w,
-                    cur);
+    cur = whisper_build_encoder_layers(wctx, ctx0, gf, cur, n_ctx, n_batch, nullptr);
 
-            Qcur = ggml_add(ctx0,
-                        Qcur,
-                        layer.attn_q_b);
+    // cross-attention memory
+    const float Kscale = pow(float(n_state_head), -0.25);
 
-            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+    for (int il = 0; il < model.hparams.n_text_layer; ++il) {
+        auto & layer = model.layers_decoder[il];
 
-            // note: no bias for Key
-            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
-                    layer.attn_k_w,
-                    cur);
+        struct ggml_tensor * Kcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_k_w,
+                cur);
 
-            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+        Kcross = ggml_scale(ctx0, Kcross, Kscale);
 
-            // store key and value to memory
-            {
-                struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
-                        layer.attn_v_w,
-                        cur);
+        struct ggml_tensor * Vcross = ggml_mul_mat(ctx0,
+                layer.cross_attn_v_w,
+                cur);
 
-                Vcur = ggml_add(ctx0,
-                            Vcur,
-                            layer.attn_v_b);
+        Vcross = ggml_add(ctx0,
+                    Vcross,
+                    layer.cross_attn_v_b);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
+        for (int ib = 0; ib < n_batch; ++ib) {
+            auto & kv_cross = states[ib]->kv_cross;
 
-                if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+            struct ggml_tensor * Kb = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], ib*n_ctx*Kcross->nb[1]);
+            struct ggml_tensor * Vb = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*n_ctx*Vcross->nb[1]);
 
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
-                } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
+            struct ggml_tensor * k;
+            struct ggml_tensor * v;
 
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
+            if (wctx.params.flash_attn) {
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx_pad));
 
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
-                }
+                v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.v)*n_state)*(il*n_ctx_pad));
+            } else {
+                Vb = ggml_transpose(ctx0, Vb);
 
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
-            }
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        (ggml_element_size(kv_cross.k)*n_state)*(il*n_ctx));
 
-            // ------
+                v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+            }
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kb, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vb, v));
+        }
+    }
 
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+    ggml_free(ctx0);
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+    return gf;
+}
 
-                cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
+// evaluate the encoder for several windows at once
+//
+//   - states:      one state per window, receives the cross-attention memory of its window
+//   - mel_offsets: offset in the mel spectrogram of each state
+//
+// the compute buffers grow with the number of windows - they are allocated for the call and freed after it
+static bool whisper_encode_batch_internal(
+                     whisper_context & wctx,
+    const std::vector<whisper_state *> & states,
+            const std::vector<int> & mel_offsets,
+                           const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
 
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+    const auto & hparams = wctx.model.hparams;
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask, 1.0f, 0.0f);
+    whisper_state & wstate0 = *states[0];
 
-                struct ggml_tensor * V =
-                    ggml_view_3d(ctx0, kv_self.v,
-                            n_kv, n_state_head, n_head,
-                            n_ctx*ggml_element_size(kv_self.v),
-                            n_ctx*ggml_element_size(kv_self.v)*n_state_head,
-                            n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+    const int n_ctx = wstate0.exp_n_audio_ctx > 0 ? wstate0.exp_n_audio_ctx : hparams.n_audio_ctx;
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+    const int graph_size = whisper_encode_batch_graph_size(hparams, states.size());
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+    whisper_sched sched;
+    sched.sched = ggml_backend_sched_new(wstate0.backends.data(), nullptr, wstate0.backends.size(), graph_size, false, true);
+    sched.meta.resize(ggml_tensor_overhead()*graph_size + ggml_graph_overhead_custom(graph_size, false));
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+    if (sched.sched == nullptr) {
+        return false;
+    }
+
+    ggml_cgraph * gf = whisper_build_graph_encoder_batch(wctx, sched, states, n_ctx, graph_size);
+
+    if (!ggml_backend_sched_alloc_graph(sched.sched, gf)) {
+        ggml_backend_sched_free(sched.sched);
+        return false;
+    }
+
+    // set the input
+    {
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        const int n_mel = hparams.n_mels;
+
+        wstate0.inp_mel.resize(ggml_nelements(mel));
+
+        float * dst = wstate0.inp_mel.data();
+        memset(dst, 0, ggml_nbytes(mel));
+
+        for (size_t ib = 0; ib < states.size(); ++ib) {
+            const auto & mel_inp = states[ib]->mel;
+
+            assert(mel_inp.n_mel == n_mel);
+
+            const int i0 = std::min(mel_offsets[ib],           mel_inp.n_len);
+            const int i1 = std::min(mel_offsets[ib] + 2*n_ctx, mel_inp.n_len);
+
+            float * dst_b = dst + ib*n_mel*2*n_ctx;
+
+            for (int j = 0; j < n_mel; ++j) {
+                for (int i = i0; i < i1; ++i) {
+                    dst_b[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
+                }
+            }
+        }
+
+        ggml_backend_tensor_set(mel, wstate0.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+    }
+
+    const bool ok = ggml_graph_compute_helper(sched.sched, gf, n_threads);
+
+    ggml_backend_sched_free(sched.sched);
+
+    if (!ok) {
+        return false;
+    }
+
+    // each window is charged its share of the batch
+    const int64_t t_encode_us = (ggml_time_us() - t_start_us)/states.size();
+
+    for (size_t ib = 0; ib < states.size(); ++ib) {
+        states[ib]->t_encode_us += t_encode_us;
+        states[ib]->n_encode++;
+
+        states[ib]->enc_mel_offset = mel_offsets[ib];
+        states[ib]->enc_n_ctx      = states[ib]->exp_n_audio_ctx;
+    }
+
+    return true;
+}
+
+// a contiguous range of tokens in the decoder graph that belongs to a single state
+// the weight matmuls run over all parts at once, the attention runs per part against the part's own KV caches
+struct whisper_decode_part {
+    whisper_state       * state;
+    const whisper_batch * batch;
+
+    int32_t i0;   // index of the first token of the part in the graph
+    int32_t n_kv; // number of self-attention KV cells to attend to
+};
+
+// number of rows for which logits are computed - at least one, so that the graph always has an output
+static int whisper_decode_n_outputs(const std::vector<whisper_decode_part> & parts) {
+    int n_outputs = 0;
+    for (const auto & part : parts) {
+        for (int i = 0; i < part.batch->n_tokens; ++i) {
+            n_outputs += part.batch->logits[i] != 0;
+        }
+    }
+
+    return std::max(1, n_outputs);
+}
+
+static struct ggml_cgraph * whisper_build_graph_decoder_parts(
+                         whisper_context & wctx,
+                           whisper_sched & sched,
+    const std::vector<whisper_decode_part> & parts,
+                                     int   graph_size,
+                                    bool   save_alignment_heads_QKs) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    const int n_state_head = n_state/n_head;
+
+    const int n_parts = parts.size();
+
+    int n_tokens = 0;
+    for (const auto & part : parts) {
+        n_tokens += part.batch->n_tokens;
+    }
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW - only supported for a single state
+    whisper_state & wstate0 = *parts[0].state;
+
+    GGML_ASSERT(n_parts == 1 || !wctx.params.dtw_token_timestamps);
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ sched.meta.size(),
+        /*.mem_buffer =*/ sched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, graph_size, false);
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
+
+    // the rows of the batch for which logits are requested
+    struct ggml_tensor * inp_out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, whisper_decode_n_outputs(parts));
+    ggml_set_name(inp_out_ids, "inp_out_ids");
+    ggml_set_input(inp_out_ids);
+
+    const float KQscale = pow(float(n_state_head), -0.25);
+
+    std::vector<ggml_tensor *> KQ_masks(n_parts);
+    std::vector<ggml_tensor *> KQ_masks_f16(n_parts);
+
+    for (int ip = 0; ip < n_parts; ++ip) {
+        const int n_tokens_p = parts[ip].batch->n_tokens;
+
+        KQ_masks[ip] = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, parts[ip].n_kv, GGML_PAD(n_tokens_p, GGML_KQ_MASK_PAD), 1);
+        ggml_format_name(KQ_masks[ip], "KQ_mask_%d", ip);
+        ggml_set_input(KQ_masks[ip]);
+
+        KQ_masks_f16[ip] = ggml_cast(ctx0, KQ_masks[ip], GGML_TYPE_F16);
+    }
+
+    // the KV cells of the new tokens of each part - filled from kv_self.slot
+    // without flash attention V is stored transposed, so its elements are scattered one by one
+    std::vector<ggml_tensor *> kv_idxs(n_parts);
+    std::vector<ggml_tensor *> v_idxs (n_parts, nullptr);
+
+    for (int ip = 0; ip < n_parts; ++ip) {
+        const int n_tokens_p = parts[ip].batch->n_tokens;
+
+        kv_idxs[ip] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I64, n_tokens_p);
+        ggml_format_name(kv_idxs[ip], "kv_idxs_%d", ip);
+        ggml_set_input(kv_idxs[ip]);
+
+        if (!wctx.params.flash_attn) {
+            v_idxs[ip] = ggml_new_tensor_1d(ctx0, GGML_TYPE_I64, n_tokens_p*n_state);
+            ggml_format_name(v_idxs[ip], "v_idxs_%d", ip);
+            ggml_set_input(v_idxs[ip]);
+        }
+    }
+
+    // rows [i0, i0 + n) of a 2d tensor
+    auto view_rows = [&](ggml_tensor * t, int i0, int n) -> ggml_tensor * {
+        if (n_parts == 1) {
+            return t;
+        }
+        return ggml_view_2d(ctx0, t, t->ne[0], n, t->nb[1], i0*t->nb[1]);
+    };
+
+    // stack the per-part attention results back into a single [n_state, n_tokens] tensor
+    auto concat_rows = [&](const std::vector<ggml_tensor *> & rows) -> ggml_tensor * {
+        ggml_tensor * res = rows[0];
+        for (size_t i = 1; i < rows.size(); ++i) {
+            res = ggml_concat(ctx0, res, rows[i], 1);
+        }
+        return res;
+    };
+
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
+
+    struct ggml_tensor * inpL = cur;
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    struct ggml_tensor * aheads_cross_QKs = nullptr;
+
+    std::vector<ggml_tensor *> rows(n_parts);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.attn_q_b);
+
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
+
+            for (int ip = 0; ip < n_parts; ++ip) {
+                const auto & part = parts[ip];
+
+                auto & kv_self = part.state->kv_self;
+
+                const int n_ctx      = kv_self.size;
+                const int n_kv       = part.n_kv;
+                const int n_tokens_p = part.batch->n_tokens;
+
+                // store key and value to memory
+                {
+                    struct ggml_tensor * Kp = view_rows(Kcur, part.i0, n_tokens_p);
+                    struct ggml_tensor * Vp = view_rows(Vcur, part.i0, n_tokens_p);
+
+                    struct ggml_tensor * k = ggml_view_2d(ctx0, kv_self.k, n_state, n_ctx,
+                            ggml_element_size(kv_self.k)*n_state,
+                            ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+
+                    struct ggml_tensor * v;
+
+                    if (wctx.params.flash_attn) {
+                        v = ggml_view_2d(ctx0, kv_self.v, n_state, n_ctx,
+                                ggml_element_size(kv_self.v)*n_state,
+                                ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+
+                        ggml_build_forward_expand(gf, ggml_set_rows(ctx0, v, Vp, kv_idxs[ip]));
+                    } else {
+                        // one element per row, the values are ordered [n_state][n_tokens_p] like v_idxs
+                        v = ggml_view_2d(ctx0, kv_self.v, 1, n_ctx*n_state,
+                                ggml_element_size(kv_self.v),
+                                ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+
+                        Vp = ggml_cont(ctx0, ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vp, n_state, n_tokens_p)));
+                        Vp = ggml_reshape_2d(ctx0, Vp, 1, n_tokens_p*n_state);
+
+                        ggml_build_forward_expand(gf, ggml_set_rows(ctx0, v, Vp, v_idxs[ip]));
+                    }
+
+                    ggml_build_forward_expand(gf, ggml_set_rows(ctx0, k, Kp, kv_idxs[ip]));
+                }
+
+                // ------
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, view_rows(Qcur, part.i0, n_tokens_p), n_state_head, n_head, n_tokens_p),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state_head, n_kv, n_head,
+                            ggml_element_size(kv_self.k)*n_state,
+                            ggml_element_size(kv_self.k)*n_state_head,
+                            ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_state_head, n_kv, n_head,
+                                ggml_element_size(kv_self.v)*n_state,
+                                ggml_element_size(kv_self.v)*n_state_head,
+                                ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+
+                    rows[ip] = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_masks_f16[ip], 1.0f, 0.0f, 0.0f);
+
+                    rows[ip] = ggml_reshape_2d(ctx0, rows[ip], n_state, n_tokens_p);
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_masks[ip], 1.0f, 0.0f);
+
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_kv, n_state_head, n_head,
+                                n_ctx*ggml_element_size(kv_self.v),
+                                n_ctx*ggml_element_size(kv_self.v)*n_state_head,
+                                n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    rows[ip] = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens_p);
+                }
             }
+
+            cur = concat_rows(rows);
         }
 
         // projection
@@ -2697,75 +3720,88 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                         Qcur,
                         layer.cross_attn_q_b);
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_tokens),
-                        0, 2, 1, 3);
+            for (int ip = 0; ip < n_parts; ++ip) {
+                const auto & part = parts[ip];
 
-            if (wctx.params.flash_attn) {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
-
-                cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
-
-                cur = ggml_reshape_2d(ctx0, cur, n_state, n_tokens);
-            } else {
-                struct ggml_tensor * Kcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.k,
-                            n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
-
-                struct ggml_tensor * Vcross =
-                    ggml_view_3d(ctx0, wstate.kv_cross.v,
-                            n_audio_ctx, n_state_head, n_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v),
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            n_audio_ctx*ggml_element_size(wstate.kv_cross.v)*n_state*il);
+                const auto & kv_cross = part.state->kv_cross;
 
-                // ------
+                const int n_tokens_p = part.batch->n_tokens;
 
-                // K * Q
-                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+                const int n_audio_ctx     = part.state->exp_n_audio_ctx > 0 ? part.state->exp_n_audio_ctx : hparams.n_audio_ctx;
+                const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
 
-                struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, view_rows(Qcur, part.i0, n_tokens_p), n_state_head, n_head, n_tokens_p),
+                            0, 2, 1, 3);
 
-                // [EXPERIMENTAL] Token-level timestamps with DTW
-                if (wctx.params.dtw_token_timestamps) {
-                    if (wstate.aheads_masks.m[il] != nullptr) {
-                        struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_mul_mat(ctx0, wstate.aheads_masks.m[il], aheads_KQs);
-                        aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_cont(ctx0, aheads_KQs);
-                        aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate.aheads_masks.m[il]->ne[1]);
-                        if (aheads_cross_QKs == NULL) {
-                            aheads_cross_QKs = aheads_KQs;
-                        } else {
-                            aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, kv_cross.k,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_element_size(kv_cross.k)*n_state,
+                                ggml_element_size(kv_cross.k)*n_state_head,
+                                ggml_element_size(kv_cross.k)*n_state*n_audio_ctx_pad*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_element_size(kv_cross.v)*n_state,
+                                ggml_element_size(kv_cross.v)*n_state_head,
+                                ggml_element_size(kv_cross.v)*n_state*n_audio_ctx_pad*il);
+
+                    rows[ip] = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
+
+                    rows[ip] = ggml_reshape_2d(ctx0, rows[ip], n_state, n_tokens_p);
+                } else {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, kv_cross.k,
+                                n_state_head, n_audio_ctx, n_head,
+                                ggml_element_size(kv_cross.k)*n_state,
+                                ggml_element_size(kv_cross.k)*n_state_head,
+                                ggml_element_size(kv_cross.k)*n_state*n_audio_ctx*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                n_audio_ctx, n_state_head, n_head,
+                                n_audio_ctx*ggml_element_size(kv_cross.v),
+                                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state_head,
+                                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state*il);
+
+                    // ------
+
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+
+                    // [EXPERIMENTAL] Token-level timestamps with DTW
+                    if (wctx.params.dtw_token_timestamps) {
+                        if (wstate0.aheads_masks.m[il] != nullptr) {
+                            struct ggml_tensor * aheads_KQs = ggml_reshape_2d(ctx0, KQ_soft_max, KQ_soft_max->ne[0] * KQ_soft_max->ne[1], KQ_soft_max->ne[2]);
+                            aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_mul_mat(ctx0, wstate0.aheads_masks.m[il], aheads_KQs);
+                            aheads_KQs = ggml_transpose(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_cont(ctx0, aheads_KQs);
+                            aheads_KQs = ggml_reshape_3d(ctx0, aheads_KQs, KQ_soft_max->ne[0], KQ_soft_max->ne[1], wstate0.aheads_masks.m[il]->ne[1]);
+                            if (aheads_cross_QKs == NULL) {
+                                aheads_cross_QKs = aheads_KQs;
+                            } else {
+                                aheads_cross_QKs = ggml_concat(ctx0, aheads_cross_QKs, aheads_KQs, 2);
+                            }
                         }
                     }
-                }
 
-                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
 
-                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens);
+                    rows[ip] = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens_p);
+                }
             }
+
+            cur = concat_rows(rows);
         }
 
         // projection
@@ -2836,10 +3872,10 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 model.d_ln_b);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
+    // compute logits only for the requested rows
+    if (inp_out_ids->ne[0] < n_tokens) {
+        cur = ggml_get_rows(ctx0, cur, inp_out_ids);
+    }
 
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
@@ -2849,7 +3885,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
         aheads_cross_QKs = ggml_cont(ctx0, aheads_cross_QKs);
         if (save_alignment_heads_QKs) {
             ggml_build_forward_expand(gf, aheads_cross_QKs);
-            wstate.aheads_cross_QKs = aheads_cross_QKs;
+            wstate0.aheads_cross_QKs = aheads_cross_QKs;
         }
     }
 
@@ -2860,6 +3896,207 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
+static struct ggml_cgraph * whisper_build_graph_decoder(
+         whisper_context & wctx,
+         whisper_state   & wstate,
+     const whisper_batch & batch,
+                    bool   save_alignment_heads_QKs,
+                    bool   worst_case) {
+    auto & kv_self = wstate.kv_self;
+
+    WHISPER_ASSERT(!!kv_self.buffer);
+
+    const int n_ctx = kv_self.size;
+
+    whisper_decode_part part;
+    part.state = &wstate;
+    part.batch = &batch;
+    part.i0    = 0;
+    part.n_kv  = worst_case ? n_ctx : kv_self.n;
+
+    return whisper_build_graph_decoder_parts(wctx, wstate.sched_decode, { part }, WHISPER_MAX_NODES, save_alignment_heads_QKs);
+}
+
+// find a KV slot for the batch and update the number of KV cells to attend to
+static bool whisper_decode_find_slot(
+        const whisper_context & wctx,
+                whisper_state & wstate,
+          const whisper_batch & batch) {
+    auto & kv_self = wstate.kv_self;
+
+    if (!whisper_kv_cache_find_slot(kv_self, batch)) {
+        return false;
+    }
+
+    const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+    kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+
+    //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
+    //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
+
+    return true;
+}
+
+static void whisper_decode_set_inputs(
+                             ggml_cgraph * gf,
+    const std::vector<whisper_decode_part> & parts,
+                      std::vector<float> & inp_mask,
+                    std::vector<int32_t> & seq_pos,
+                    std::vector<int64_t> & v_idxs) {
+    struct ggml_tensor * embd        = ggml_graph_get_tensor(gf, "embd");
+    struct ggml_tensor * position    = ggml_graph_get_tensor(gf, "position");
+    struct ggml_tensor * inp_out_ids = ggml_graph_get_tensor(gf, "inp_out_ids");
+
+    // the row of the batch for each output - see whisper_decode_get_logits()
+    // not part of the graph when logits are requested for all rows
+    if (inp_out_ids) {
+        std::vector<int32_t> out_ids;
+        out_ids.reserve(ggml_nelements(inp_out_ids));
+
+        int n_tokens = 0;
+        for (const auto & part : parts) {
+            for (int i = 0; i < part.batch->n_tokens; ++i) {
+                if (part.batch->logits[i] != 0) {
+                    out_ids.push_back(n_tokens + i);
+                }
+            }
+            n_tokens += part.batch->n_tokens;
+        }
+
+        if (out_ids.empty()) {
+            out_ids.push_back(n_tokens - 1);
+        }
+
+        ggml_backend_tensor_set(inp_out_ids, out_ids.data(), 0, out_ids.size()*sizeof(int32_t));
+    }
+
+    for (int ip = 0; ip < (int) parts.size(); ++ip) {
+        const auto & part    = parts[ip];
+        const auto & batch   = *part.batch;
+        const auto & kv_self = part.state->kv_self;
+
+        const int n_tokens = batch.n_tokens;
+
+        ggml_backend_tensor_set(embd,     batch.token, part.i0*sizeof(int32_t), n_tokens*sizeof(int32_t));
+        ggml_backend_tensor_set(position, batch.pos,   part.i0*sizeof(int32_t), n_tokens*sizeof(int32_t));
+
+        // the KV cells of the new tokens
+        {
+            struct ggml_tensor * kv_idxs = ggml_graph_get_tensor(gf, format("kv_idxs_%d", ip).c_str());
+            struct ggml_tensor * v_dst   = ggml_graph_get_tensor(gf, format("v_idxs_%d",  ip).c_str());
+
+            WHISPER_ASSERT((int) kv_self.slot.size() == n_tokens);
+
+            ggml_backend_tensor_set(kv_idxs, kv_self.slot.data(), 0, n_tokens*sizeof(int64_t));
+
+            // transposed V: element [i][j] of the new values goes to [i][slot[j]] of the cache
+            if (v_dst) {
+                const int64_t n_state = ggml_nelements(v_dst)/n_tokens;
+
+                v_idxs.resize(ggml_nelements(v_dst));
+                for (int64_t i = 0; i < n_state; ++i) {
+                    for (int j = 0; j < n_tokens; ++j) {
+                        v_idxs[i*n_tokens + j] = i*kv_self.size + kv_self.slot[j];
+                    }
+                }
+
+                ggml_backend_tensor_set(v_dst, v_idxs.data(), 0, ggml_nbytes(v_dst));
+            }
+        }
+
+        struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, format("KQ_mask_%d", ip).c_str());
+
+        const int32_t n_kv = part.n_kv;
+
+        inp_mask.resize(ggml_nelements(KQ_mask));
+
+        float * data = inp_mask.data();
+
+        // for each sequence of the batch, the position of the cells that belong to it and INT32_MAX for the others
+        // it is computed once per sequence - the mask row of a token is then a single comparison per cell
+        int32_t seq_row[WHISPER_KV_MAX_SEQ];
+        std::fill(seq_row, seq_row + WHISPER_KV_MAX_SEQ, -1);
+
+        int32_t n_seq = 0;
+        for (int j = 0; j < n_tokens; ++j) {
+            const whisper_seq_id seq_id = batch.seq_id[j][0];
+            WHISPER_ASSERT(seq_id >= 0 && seq_id < WHISPER_KV_MAX_SEQ);
+            if (seq_row[seq_id] < 0) {
+                seq_row[seq_id] = n_seq++;
+            }
+        }
+
+        seq_pos.resize((size_t) n_seq*n_kv);
+
+        for (int s = 0; s < WHISPER_KV_MAX_SEQ; ++s) {
+            if (seq_row[s] < 0) {
+                continue;
+            }
+
+            const uint64_t bit = whisper_kv_seq_bit(s);
+
+            int32_t * dst = seq_pos.data() + (size_t) seq_row[s]*n_kv;
+            for (int i = 0; i < n_kv; ++i) {
+                dst[i] = kv_self.cells_seq[i] & bit ? kv_self.cells_pos[i] : INT32_MAX;
+            }
+        }
+
+        for (int j = 0; j < n_tokens; ++j) {
+            const whisper_pos pos = batch.pos[j];
+
+            const int32_t * src = seq_pos.data() + (size_t) seq_row[batch.seq_id[j][0]]*n_kv;
+                    float * row = data + j*n_kv;
+
+            for (int i = 0; i < n_kv; ++i) {
+                row[i] = src[i] <= pos ? 0.0f : -INFINITY;
+            }
+        }
+
+        std::fill(data + n_tokens*n_kv, data + GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv, -INFINITY);
+
+        ggml_backend_tensor_set(KQ_mask, inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+    }
+}
+
+// copy the requested rows of the logits of a part into the state
+// the graph only computes the requested rows - the ones of this part start at output row i_out
+// returns the number of rows of the part
+static int whisper_decode_get_logits(
+                struct ggml_tensor * logits,
+         const whisper_decode_part & part,
+                               int   i_out,
+                               int   n_vocab) {
+    const auto & batch = *part.batch;
+
+    auto & logits_out = part.state->logits;
+
+    int n_out = 0;
+
+    logits_out.resize(batch.n_tokens*n_vocab);
+    for (int i = 0; i < batch.n_tokens; i++) {
+        if (batch.logits[i] == 0) {
+            continue;
+        }
+        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*(i_out + n_out)), sizeof(float)*n_vocab);
+        n_out++;
+    }
+
+    return n_out;
+}
+
+static void whisper_decode_update_timings(whisper_state & wstate, int n_tokens, int64_t t_start_us) {
+    if (n_tokens == 1) {
+        wstate.t_decode_us += ggml_time_us() - t_start_us;
+        wstate.n_decode++;
+    } else if (n_tokens < 16) {
+        wstate.t_batchd_us += ggml_time_us() - t_start_us;
+        wstate.n_batchd += n_tokens;
+    } else {
+        wstate.t_prompt_us += ggml_time_us() - t_start_us;
+        wstate.n_prompt += n_tokens;
+    }
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2883,26 +4120,11 @@ static bool whisper_decode_internal(
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
-    const int n_vocab  = hparams.n_vocab;
-    const int n_tokens = batch.n_tokens;
-
-    auto & logits_out = wstate.logits;
-
-    struct ggml_tensor * logits;
+    const int n_vocab = hparams.n_vocab;
 
     // find KV slot for the batch
-    {
-        auto & kv_self = wstate.kv_self;
-
-        if (!whisper_kv_cache_find_slot(kv_self, batch)) {
-            return false;
-        }
-
-        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
-        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
-
-        //kv_self.n = std::min((int32_t) hparams.n_text_ctx, std::max(32, whisper_kv_cache_cell_max(kv_self)));
-        //printf("n_tokens = %5d, kv_self.head = %5d, kv_self.n = %5d, seq_id = %5d\n", batch.n_tokens, kv_self.head, kv_self.n, batch.seq_id[0][0]);
+    if (!whisper_decode_find_slot(wctx, wstate, batch)) {
+        return false;
     }
 
     // decoder
@@ -2916,87 +4138,199 @@ static bool whisper_decode_internal(
             return false;
         }
 
+        whisper_decode_part part;
+        part.state = &wstate;
+        part.batch = &batch;
+        part.i0    = 0;
+        part.n_kv  = wstate.kv_self.n;
+
         // set the inputs
-        {
-            struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
-            ggml_backend_tensor_set(embd, batch.token, 0, n_tokens*ggml_element_size(embd));
-        }
+        whisper_decode_set_inputs(gf, { part }, wstate.inp_mask, wstate.inp_seq_pos, wstate.inp_v_idxs);
 
-        {
-            struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
-            for (int i = 0; i < n_tokens; ++i) {
-                const int32_t val = batch.pos[i];
-                ggml_backend_tensor_set(position, &val, i*sizeof(int32_t), sizeof(int32_t));
-            }
+        struct ggml_tensor * logits = ggml_graph_node(gf, -1);
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            return false;
         }
 
-        {
-            struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
+        whisper_decode_get_logits(logits, part, 0, n_vocab);
+    }
 
-            auto & kv_self = wstate.kv_self;
+    whisper_decode_update_timings(wstate, batch.n_tokens, t_start_us);
 
-            const int32_t n_kv = kv_self.n;
+    return !(abort_callback && abort_callback(abort_callback_data));
+}
 
-            wstate.inp_mask.resize(ggml_nelements(KQ_mask));
+// continuous batching of the text-generation steps of several states
+//
+// each state submits its next-token batch and waits - the first thread that finds the step ready (all generating
+// states have submitted, or wait_us has passed) computes one graph for all pending batches and hands out the logits
+struct whisper_batcher {
+    struct request {
+        whisper_state       * state;
+        const whisper_batch * batch;
+
+        bool done;
+        bool ok;
+    };
 
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
+    whisper_context * ctx = nullptr;
 
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+    int n_states_max = 1;
+    int wait_us      = 0;
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
+    std::vector<ggml_backend_t> backends;
 
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
-                }
-            }
+    whisper_sched sched;
 
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
-        }
+    std::vector<float>   inp_mask;
+    std::vector<int32_t> inp_seq_pos;
+    std::vector<int64_t> inp_v_idxs;
 
-        logits = ggml_graph_node(gf, -1);
+    std::mutex              mutex;
+    std::condition_variable cv;
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
-            return false;
+    int  n_active = 0;     // number of attached states currently generating tokens
+    bool busy     = false; // a step is being computed
+
+    std::vector<request *> pending;
+};
+
+// marks a state as generating tokens for the lifetime of the guard, so that steps wait for its batches
+struct whisper_batcher_guard {
+    whisper_batcher * batcher;
+
+    explicit whisper_batcher_guard(whisper_batcher * batcher) : batcher(batcher) {
+        if (batcher) {
+            std::lock_guard<std::mutex> lock(batcher->mutex);
+            batcher->n_active++;
         }
     }
 
-    logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
-        if (batch.logits[i] == 0) {
+    ~whisper_batcher_guard() {
+        if (batcher) {
+            std::lock_guard<std::mutex> lock(batcher->mutex);
+            batcher->n_active--;
+            batcher->cv.notify_all();
+        }
+    }
+};
+
+static bool whisper_batcher_step(whisper_batcher & batcher, const std::vector<whisper_batcher::request *> & reqs, int n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    whisper_context & wctx = *batcher.ctx;
+
+    std::vector<whisper_decode_part> parts;
+
+    int n_tokens = 0;
+
+    for (auto * req : reqs) {
+        req->ok = whisper_decode_find_slot(wctx, *req->state, *req->batch);
+        if (!req->ok) {
             continue;
         }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+
+        whisper_decode_part part;
+        part.state = req->state;
+        part.batch = req->batch;
+        part.i0    = n_tokens;
+        part.n_kv  = req->state->kv_self.n;
+
+        parts.push_back(part);
+
+        n_tokens += req->batch->n_tokens;
     }
 
-    if (batch.n_tokens > 1) {
-        //printf("%s: used_mem = %f MB, %f MB, %f MB %f MB %f MB\n", __func__,
-        //        ggml_used_mem(ctx0)/1e6,
-        //        wstate.get_buf_max_mem(0)/1e6,
-        //        wstate.get_buf_max_mem(1)/1e6,
-        //        wstate.get_buf_max_mem(2)/1e6,
-        //        wstate.get_buf_max_mem(3)/1e6);
+    if (parts.empty()) {
+        return true;
     }
 
-    if (batch.n_tokens == 1) {
-        wstate.t_decode_us += ggml_time_us() - t_start_us;
-        wstate.n_decode++;
-    } else if (batch.n_tokens < 16) {
-        wstate.t_batchd_us += ggml_time_us() - t_start_us;
-        wstate.n_batchd += n_tokens;
-    } else {
-        wstate.t_prompt_us += ggml_time_us() - t_start_us;
-        wstate.n_prompt += n_tokens;
+    auto & sched = batcher.sched.sched;
+
+    ggml_cgraph * gf = whisper_build_graph_decoder_parts(wctx, batcher.sched, parts, WHISPER_MAX_NODES*batcher.n_states_max, false);
+
+    // the compute buffers grow on demand, as the size of the step depends on the states that take part in it
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        return false;
+    }
+
+    whisper_decode_set_inputs(gf, parts, batcher.inp_mask, batcher.inp_seq_pos, batcher.inp_v_idxs);
+
+    struct ggml_tensor * logits = ggml_graph_node(gf, -1);
+
+    if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        return false;
+    }
+
+    int i_out = 0;
+
+    for (const auto & part : parts) {
+        i_out += whisper_decode_get_logits(logits, part, i_out, wctx.model.hparams.n_vocab);
+        whisper_decode_update_timings(*part.state, part.batch->n_tokens, t_start_us);
+    }
+
+    return true;
+}
+
+static bool whisper_batcher_decode(whisper_batcher & batcher, whisper_state & wstate, const whisper_batch & batch, int n_threads) {
+    whisper_batcher::request req = { &wstate, &batch, false, false };
+
+    const auto t_deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(batcher.wait_us);
+
+    std::unique_lock<std::mutex> lock(batcher.mutex);
+
+    batcher.pending.push_back(&req);
+    batcher.cv.notify_all();
+
+    while (!req.done) {
+        const int n_ready = std::min(batcher.n_active, batcher.n_states_max);
+
+        if (batcher.busy) {
+            batcher.cv.wait(lock);
+        } else if ((int) batcher.pending.size() >= n_ready || std::chrono::steady_clock::now() >= t_deadline) {
+            // compute the step for the pending requests on this thread
+            const size_t n = std::min(batcher.pending.size(), (size_t) batcher.n_states_max);
+
+            std::vector<whisper_batcher::request *> reqs(batcher.pending.begin(), batcher.pending.begin() + n);
+            batcher.pending.erase(batcher.pending.begin(), batcher.pending.begin() + n);
+
+            batcher.busy = true;
+            lock.unlock();
+
+            const bool ok = whisper_batcher_step(batcher, reqs, n_threads);
+
+            lock.lock();
+            batcher.busy = false;
+
+            for (auto * r : reqs) {
+                r->ok   = r->ok && ok;
+                r->done = true;
+            }
+
+            batcher.cv.notify_all();
+        } else {
+            batcher.cv.wait_until(lock, t_deadline);
+        }
+    }
+
+    return req.ok;
+}
+
+// decode a text-generation step, shared with the other states of the batcher if the state is attached to one
+static bool whisper_decode_step(
+        whisper_context & wctx,
+          whisper_state & wstate,
+    const whisper_batch & batch,
+              const int   n_threads,
+    ggml_abort_callback   abort_callback,
+                   void * abort_callback_data) {
+    if (wstate.batcher == nullptr) {
+        return whisper_decode_internal(wctx, wstate, batch, n_threads, false, abort_callback, abort_callback_data);
+    }
+
+    if (!whisper_batcher_decode(*wstate.batcher, wstate, batch, n_threads)) {
+        return false;
     }
 
     return !(abort_callback && abort_callback(abort_callback_data));
@@ -3021,6 +4355,84 @@ static std::string to_timestamp(int64_t t, bool comma = false) {
 
 #define SIN_COS_N_COUNT WHISPER_N_FFT
 namespace {
+// precomputed plan for the real-input FFT used by the log-mel spectrogram
+//
+// the n real samples are packed into a complex sequence of size m = n/2, which is transformed with an iterative
+// mixed-radix (5/4/2) Stockham FFT and then split into the n/2 + 1 bins of the real spectrum
+// all twiddle factors are computed once, in double precision, so the hot loop does no trigonometry and no allocations
+struct whisper_rfft_plan {
+    struct stage {
+        int radix;
+        int stride; // product of the radices of the previous stages
+
+        // twiddles for the inputs 1..radix-1 of each butterfly: [(radix - 1)*stride]
+        std::vector<float> tw_re;
+        std::vector<float> tw_im;
+    };
+
+    int n = 0; // real input size
+    int m = 0; // complex FFT size
+
+    std::vector<stage> stages;
+
+    // exp(-2*pi*i*k/n), k = 0 .. m
+    std::vector<float> split_re;
+    std::vector<float> split_im;
+
+    bool init(int n_real) {
+        n = n_real;
+        m = n_real/2;
+
+        stages.clear();
+
+        if (n < 2 || n % 2 != 0) {
+            return false;
+        }
+
+        std::vector<int> radices;
+        {
+            int r = m;
+            while (r % 5 == 0) { radices.push_back(5); r /= 5; }
+            while (r % 4 == 0) { radices.push_back(4); r /= 4; }
+            while (r % 2 == 0) { radices.push_back(2); r /= 2; }
+
+            if (r != 1) {
+                return false;
+            }
+        }
+
+        int stride = 1;
+        for (int radix : radices) {
+            stage st;
+            st.radix  = radix;
+            st.stride = stride;
+            st.tw_re.resize((radix - 1)*stride);
+            st.tw_im.resize((radix - 1)*stride);
+
+            for (int r = 1; r < radix; ++r) {
+                for (int t = 0; t < stride; ++t) {
+                    const double theta = -2.0*M_PI*r*t/(stride*radix);
+                    st.tw_re[(r - 1)*stride + t] = cos(theta);
+                    st.tw_im[(r - 1)*stride + t] = sin(theta);
+                }
+            }
+
+            stages.push_back(std::move(st));
+            stride *= radix;
+        }
+
+        split_re.resize(m + 1);
+        split_im.resize(m + 1);
+        for (int k = 0; k <= m; ++k) {
+            const double theta = -2.0*M_PI*k/n;
+            split_re[k] = cos(theta);
+            split_im[k] = sin(theta);
+        }
+
+        return true;
+    }
+};
+
 struct whisper_global_cache {
     // In FFT, we frequently use sine and cosine operations with the same values.
     // We can use precalculated values to speed up the process.
@@ -3032,9 +4444,16 @@ struct whisper_global_cache {
     // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
     float hann_window[WHISPER_N_FFT];
 
+    // real-input FFT of size WHISPER_N_FFT
+    whisper_rfft_plan rfft_plan;
+
     whisper_global_cache() {
         fill_sin_cos_table();
         fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+
+        if (!rfft_plan.init(WHISPER_N_FFT)) {
+            WHISPER_ASSERT(false && "unsupported FFT size");
+        }
     }
 
     void fill_sin_cos_table() {
@@ -3058,6 +4477,7 @@ struct whisper_global_cache {
 }
 
 // naive Discrete Fourier Transform
+// reference implementation, used only by whisper_bench_fft
 // input is real-valued
 // output is complex-valued
 static void dft(const float* in, int N, float* out) {
@@ -3079,7 +4499,7 @@ static void dft(const float* in, int N, float* out) {
 }
 
 // Cooley-Tukey FFT
-// poor man's implementation - use something better
+// reference implementation, used only by whisper_bench_fft
 // input is real-valued
 // output is complex-valued
 static void fft(float* in, int N, float* out) {
@@ -3115,172 +4535,652 @@ static void fft(float* in, int N, float* out) {
         float re = global_cache.cos_vals[idx]; // cos(t)
         float im = -global_cache.sin_vals[idx]; // sin(t)
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        float re_odd = odd_fft[2*k + 0];
+        float im_odd = odd_fft[2*k + 1];
+
+        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
+        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+
+        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
+        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    }
+}
+
+// Stockham butterflies of the planned FFT
+// each stage reads x[b*stride + t + r*step] and writes y[b*stride*radix + t + r*stride] for r = 0 .. radix-1
+// the inner loops run over t with unit stride and separate re/im arrays, so that they can be vectorized
+static void rfft_stage_radix2(const whisper_rfft_plan::stage & st, int step,
+        const float * GGML_RESTRICT x_re, const float * GGML_RESTRICT x_im,
+              float * GGML_RESTRICT y_re,       float * GGML_RESTRICT y_im) {
+    const int ns = st.stride;
+    const float * w1_re = st.tw_re.data();
+    const float * w1_im = st.tw_im.data();
+
+    for (int b = 0; b < step/ns; ++b) {
+        const float * a_re = x_re + b*ns;
+        const float * a_im = x_im + b*ns;
+        float * d_re = y_re + b*ns*2;
+        float * d_im = y_im + b*ns*2;
+
+        for (int t = 0; t < ns; ++t) {
+            const float a0r = a_re[t];
+            const float a0i = a_im[t];
+            const float a1r = a_re[t + step]*w1_re[t] - a_im[t + step]*w1_im[t];
+            const float a1i = a_re[t + step]*w1_im[t] + a_im[t + step]*w1_re[t];
+
+            d_re[t]      = a0r + a1r;
+            d_im[t]      = a0i + a1i;
+            d_re[t + ns] = a0r - a1r;
+            d_im[t + ns] = a0i - a1i;
+        }
+    }
+}
+
+static void rfft_stage_radix4(const whisper_rfft_plan::stage & st, int step,
+        const float * GGML_RESTRICT x_re, const float * GGML_RESTRICT x_im,
+              float * GGML_RESTRICT y_re,       float * GGML_RESTRICT y_im) {
+    const int ns = st.stride;
+    const float * w1_re = st.tw_re.data();
+    const float * w1_im = st.tw_im.data();
+    const float * w2_re = w1_re + ns;
+    const float * w2_im = w1_im + ns;
+    const float * w3_re = w2_re + ns;
+    const float * w3_im = w2_im + ns;
+
+    for (int b = 0; b < step/ns; ++b) {
+        const float * a_re = x_re + b*ns;
+        const float * a_im = x_im + b*ns;
+        float * d_re = y_re + b*ns*4;
+        float * d_im = y_im + b*ns*4;
+
+        for (int t = 0; t < ns; ++t) {
+            const float a0r = a_re[t];
+            const float a0i = a_im[t];
+            const float a1r = a_re[t + 1*step]*w1_re[t] - a_im[t + 1*step]*w1_im[t];
+            const float a1i = a_re[t + 1*step]*w1_im[t] + a_im[t + 1*step]*w1_re[t];
+            const float a2r = a_re[t + 2*step]*w2_re[t] - a_im[t + 2*step]*w2_im[t];
+            const float a2i = a_re[t + 2*step]*w2_im[t] + a_im[t + 2*step]*w2_re[t];
+            const float a3r = a_re[t + 3*step]*w3_re[t] - a_im[t + 3*step]*w3_im[t];
+            const float a3i = a_re[t + 3*step]*w3_im[t] + a_im[t + 3*step]*w3_re[t];
+
+            const float t0r = a0r + a2r, t0i = a0i + a2i;
+            const float t1r = a0r - a2r, t1i = a0i - a2i;
+            const float t2r = a1r + a3r, t2i = a1i + a3i;
+            const float t3r = a1r - a3r, t3i = a1i - a3i;
+
+            // y1 = t1 - i*t3, y3 = t1 + i*t3
+            d_re[t + 0*ns] = t0r + t2r;
+            d_im[t + 0*ns] = t0i + t2i;
+            d_re[t + 1*ns] = t1r + t3i;
+            d_im[t + 1*ns] = t1i - t3r;
+            d_re[t + 2*ns] = t0r - t2r;
+            d_im[t + 2*ns] = t0i - t2i;
+            d_re[t + 3*ns] = t1r - t3i;
+            d_im[t + 3*ns] = t1i + t3r;
+        }
+    }
+}
+
+static void rfft_stage_radix5(const whisper_rfft_plan::stage & st, int step,
+        const float * GGML_RESTRICT x_re, const float * GGML_RESTRICT x_im,
+              float * GGML_RESTRICT y_re,       float * GGML_RESTRICT y_im) {
+    const float c1 = (float) cos(2.0*M_PI/5.0);
+    const float c2 = (float) cos(4.0*M_PI/5.0);
+    const float s1 = (float) sin(2.0*M_PI/5.0);
+    const float s2 = (float) sin(4.0*M_PI/5.0);
+
+    const int ns = st.stride;
+    const float * w1_re = st.tw_re.data();
+    const float * w1_im = st.tw_im.data();
+    const float * w2_re = w1_re + ns;
+    const float * w2_im = w1_im + ns;
+    const float * w3_re = w2_re + ns;
+    const float * w3_im = w2_im + ns;
+    const float * w4_re = w3_re + ns;
+    const float * w4_im = w3_im + ns;
+
+    for (int b = 0; b < step/ns; ++b) {
+        const float * a_re = x_re + b*ns;
+        const float * a_im = x_im + b*ns;
+        float * d_re = y_re + b*ns*5;
+        float * d_im = y_im + b*ns*5;
+
+        for (int t = 0; t < ns; ++t) {
+            const float a0r = a_re[t];
+            const float a0i = a_im[t];
+            const float a1r = a_re[t + 1*step]*w1_re[t] - a_im[t + 1*step]*w1_im[t];
+            const float a1i = a_re[t + 1*step]*w1_im[t] + a_im[t + 1*step]*w1_re[t];
+            const float a2r = a_re[t + 2*step]*w2_re[t] - a_im[t + 2*step]*w2_im[t];
+            const float a2i = a_re[t + 2*step]*w2_im[t] + a_im[t + 2*step]*w2_re[t];
+            const float a3r = a_re[t + 3*step]*w3_re[t] - a_im[t + 3*step]*w3_im[t];
+            const float a3i = a_re[t + 3*step]*w3_im[t] + a_im[t + 3*step]*w3_re[t];
+            const float a4r = a_re[t + 4*step]*w4_re[t] - a_im[t + 4*step]*w4_im[t];
+            const float a4i = a_re[t + 4*step]*w4_im[t] + a_im[t + 4*step]*w4_re[t];
+
+            const float b1r = a1r + a4r, b1i = a1i + a4i;
+            const float b2r = a2r + a3r, b2i = a2i + a3i;
+            const float b3r = a1r - a4r, b3i = a1i - a4i;
+            const float b4r = a2r - a3r, b4i = a2i - a3i;
+
+            const float m1r = a0r + c1*b1r + c2*b2r, m1i = a0i + c1*b1i + c2*b2i;
+            const float m2r = a0r + c2*b1r + c1*b2r, m2i = a0i + c2*b1i + c1*b2i;
+            const float n1r = s1*b3r + s2*b4r,       n1i = s1*b3i + s2*b4i;
+            const float n2r = s2*b3r - s1*b4r,       n2i = s2*b3i - s1*b4i;
+
+            // y1 = m1 - i*n1, y4 = m1 + i*n1, y2 = m2 - i*n2, y3 = m2 + i*n2
+            d_re[t + 0*ns] = a0r + b1r + b2r;
+            d_im[t + 0*ns] = a0i + b1i + b2i;
+            d_re[t + 1*ns] = m1r + n1i;
+            d_im[t + 1*ns] = m1i - n1r;
+            d_re[t + 2*ns] = m2r + n2i;
+            d_im[t + 2*ns] = m2i - n2r;
+            d_re[t + 3*ns] = m2r - n2i;
+            d_im[t + 3*ns] = m2i + n2r;
+            d_re[t + 4*ns] = m1r - n1i;
+            d_im[t + 4*ns] = m1i + n1r;
+        }
+    }
+}
+
+// planned real-input FFT
+// in:   plan.n real values
+// out:  plan.n/2 + 1 complex values (interleaved re, im)
+// work: scratch buffer of at least 2*plan.n floats
+static void rfft(const whisper_rfft_plan & plan, const float * in, float * out, float * work) {
+    const int m = plan.m;
+
+    float * x_re = work + 0*m;
+    float * x_im = work + 1*m;
+    float * y_re = work + 2*m;
+    float * y_im = work + 3*m;
+
+    // pack the even samples into the real part and the odd samples into the imaginary part
+    for (int i = 0; i < m; ++i) {
+        x_re[i] = in[2*i + 0];
+        x_im[i] = in[2*i + 1];
+    }
+
+    for (const auto & st : plan.stages) {
+        const int step = m/st.radix;
+
+        switch (st.radix) {
+            case 2: rfft_stage_radix2(st, step, x_re, x_im, y_re, y_im); break;
+            case 4: rfft_stage_radix4(st, step, x_re, x_im, y_re, y_im); break;
+            case 5: rfft_stage_radix5(st, step, x_re, x_im, y_re, y_im); break;
+            default: GGML_ABORT("unsupported radix");
+        }
+
+        std::swap(x_re, y_re);
+        std::swap(x_im, y_im);
+    }
+
+    // split the spectrum of the packed sequence Z into the spectrum of the real input X:
+    //   X[k] = (Z[k] + conj(Z[m-k]))/2 + exp(-2*pi*i*k/n)*(Z[k] - conj(Z[m-k]))/(2i)
+    out[0]     = x_re[0] + x_im[0];
+    out[1]     = 0.0f;
+    out[2*m]   = x_re[0] - x_im[0];
+    out[2*m+1] = 0.0f;
+
+    for (int k = 1; k < m; ++k) {
+        const float ar = x_re[k];
+        const float ai = x_im[k];
+        const float br = x_re[m - k];
+        const float bi = x_im[m - k];
+
+        const float e_re = 0.5f*(ar + br);
+        const float e_im = 0.5f*(ai - bi);
+        const float o_re = 0.5f*(ai + bi);
+        const float o_im = 0.5f*(br - ar);
+
+        const float wr = plan.split_re[k];
+        const float wi = plan.split_im[k];
+
+        out[2*k + 0] = e_re + wr*o_re - wi*o_im;
+        out[2*k + 1] = e_im + wr*o_im + wi*o_re;
+    }
+}
+
+// log mel values of a single frame
+// only the first n_avail samples of the frame are read, the rest is treated as zeros
+// the n_mel values are written to dst with the given stride and their maximum is returned
+// fft_in, fft_out and fft_work are scratch buffers of frame_size, frame_size + 2 and 2*frame_size floats
+static float log_mel_spectrogram_frame(const float * hann, const float * frame, int n_avail, int frame_size,
+                                       const whisper_filters & filters, int n_mel,
+                                       float * fft_in, float * fft_out, float * fft_work,
+                                       float * dst, int64_t stride) {
+    const whisper_rfft_plan & plan = global_cache.rfft_plan;
+
+    const int n_fft = filters.n_fft;
+
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    assert(n_fft == 1 + (frame_size / 2));
+    assert(frame_size == plan.n);
+
+    n_avail = std::max(0, std::min(frame_size, n_avail));
+
+    // apply Hann window (~10% faster)
+    for (int j = 0; j < n_avail; j++) {
+        fft_in[j] = hann[j] * frame[j];
+    }
+
+    // fill the rest with zeros
+    std::fill(fft_in + n_avail, fft_in + frame_size, 0.0f);
+
+    // FFT
+    rfft(plan, fft_in, fft_out, fft_work);
+
+    // Calculate modulus^2 of complex numbers
+    // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
+    for (int j = 0; j < n_fft; j++) {
+        fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
+    }
+
+    float mmax = -1e20f;
+
+    // mel spectrogram
+    // each mel band covers only a few FFT bins, so use the sparse layout of the filters
+    for (int j = 0; j < n_mel; j++) {
+        const float * p = fft_out + filters.start[j];
+        const float * w = filters.weights.data() + filters.offs[j];
+
+        float sum = 0.0f;
+        for (int k = 0; k < filters.len[j]; k++) {
+            sum += p[k]*w[k];
+        }
+
+        const float val = log10f(std::max(sum, 1e-10f));
+        dst[j * stride] = val;
+
+        mmax = std::max(mmax, val);
+    }
+
+    return mmax;
+}
+
+static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, whisper_mel & mel, float & mmax) {
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(frame_size + 2);
+    std::vector<float> fft_work(frame_size * 2);
+
+    int i = ith;
+
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
+
+        const float val = log_mel_spectrogram_frame(hann, samples.data() + offset, n_samples - offset, frame_size,
+                filters, mel.n_mel, fft_in.data(), fft_out.data(), fft_work.data(), mel.data.data() + i, mel.n_len);
+
+        // track the maximum for the normalization
+        mmax = std::max(mmax, val);
+    }
+
+    // Otherwise fft_out are all zero
+    const float val = log10f(1e-10f);
+    if (i < mel.n_len) {
+        mmax = std::max(mmax, val);
+    }
+    for (; i < mel.n_len; i += n_threads) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = val;
+        }
+    }
+}
+
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
+static bool log_mel_spectrogram(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              const bool   debug,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // Hann window
+    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
+    const float * hann = global_cache.hann_window;
+
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
+
+    // Initialize a vector and copy data from C array to it.
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+
+    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+
+    // reflective pad 200 samples at the beginning of audio
+    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+
+    mel.n_mel     = n_mel;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    // maximum of the log-mel values seen by each worker
+    std::vector<float> mmax_th(n_threads, -1e20f);
+
+    whisper_worker_pool_run(wstate.workers, n_threads, [&](int ith) {
+        log_mel_spectrogram_worker_thread(ith, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel, mmax_th[ith]);
+    });
+
+    // clamping and normalization in a single pass
+    {
+        const float mmax = *std::max_element(mmax_th.begin(), mmax_th.end()) - 8.0f;
+
+        float * data = mel.data.data();
+        const int n  = mel.n_mel*mel.n_len;
+
+        for (int i = 0; i < n; i++) {
+            data[i] = (std::max(data[i], mmax) + 4.0f)/4.0f;
+        }
+    }
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
+
+    return true;
+}
+
+// same as log_mel_spectrogram(), but only the frames in the given ranges [f0, f1) are computed from the audio
+// the samples are read in place - the other frames get the value of silence, as if the audio was zero outside of them
+// with a single range covering all of the frames, the result is identical to log_mel_spectrogram()
+static bool log_mel_spectrogram_ranges(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const std::vector<std::pair<int, int>> & ranges,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
+    const float * hann = global_cache.hann_window;
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+    const int pad = frame_size / 2;
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
-    }
-}
+    // same dimensions as the spectrogram of the padded audio
+    mel.n_mel     = n_mel;
+    mel.n_len     = (n_samples + WHISPER_SAMPLE_RATE * 30 + 2 * pad - frame_size) / frame_step;
+    mel.n_len_org = 1 + (n_samples + pad - frame_size) / frame_step;
+    mel.data.assign(mel.n_mel * mel.n_len, log10f(1e-10f));
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    // maximum of the log-mel values seen by each worker - there is always at least one silent frame at the end
+    std::vector<float> mmax_th(n_threads, log10f(1e-10f));
 
-    int n_fft = filters.n_fft;
-    int i = ith;
+    whisper_worker_pool_run(wstate.workers, n_threads, [&](int ith) {
+        std::vector<float> fft_in(frame_size, 0.0);
+        std::vector<float> fft_out(frame_size + 2);
+        std::vector<float> fft_work(frame_size * 2);
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert(n_fft == 1 + (frame_size / 2));
+        // the frames at the start of the audio, which overlap the reflective pad
+        std::vector<float> frame_pad(frame_size);
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+        for (const auto & r : ranges) {
+            const int f0 = std::max(0, r.first);
+            const int f1 = std::min(mel.n_len, r.second);
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
+            for (int i = f0 + ith; i < f1; i += n_threads) {
+                const int offset = i * frame_step - pad;
 
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+                const float * frame = samples + std::min(offset, n_samples);
+                int n_avail = n_samples - offset;
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
+                if (offset < 0) {
+                    for (int j = 0; j < frame_size; j++) {
+                        const int k = offset + j;
+                        frame_pad[j] = k < 0 ? (-k < n_samples ? samples[-k] : 0.0f) : (k < n_samples ? samples[k] : 0.0f);
+                    }
+                    frame   = frame_pad.data();
+                    n_avail = frame_size;
+                }
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+                const float val = log_mel_spectrogram_frame(hann, frame, n_avail, frame_size,
+                        filters, mel.n_mel, fft_in.data(), fft_out.data(), fft_work.data(), mel.data.data() + i, mel.n_len);
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
+                mmax_th[ith] = std::max(mmax_th[ith], val);
             }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
         }
-    }
+    });
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
+    // clamping and normalization in a single pass
+    {
+        const float mmax = *std::max_element(mmax_th.begin(), mmax_th.end()) - 8.0f;
+
+        float * data = mel.data.data();
+        const int n  = mel.n_mel*mel.n_len;
+
+        for (int i = 0; i < n; i++) {
+            data[i] = (std::max(data[i], mmax) + 4.0f)/4.0f;
         }
     }
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    return true;
 }
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
-static bool log_mel_spectrogram(
+// incremental version of log_mel_spectrogram() for audio streams
+// the new samples are appended to the stream, only the frames that no longer depend on future samples are computed
+// and cached, and the normalized spectrogram of the window is rebuilt from the cached frames
+// with n_keep > 0, whole frames are dropped from the front of the window while it has more than n_keep samples
+static bool log_mel_spectrogram_append(
               whisper_state & wstate,
+         whisper_mel_stream & stream,
               const float * samples,
               const int   n_samples,
-              const int   /*sample_rate*/,
+              const int   n_keep,
               const int   frame_size,
               const int   frame_step,
               const int   n_mel,
               const int   n_threads,
               const whisper_filters & filters,
-              const bool   debug,
               whisper_mel & mel) {
     const int64_t t_start_us = ggml_time_us();
 
-    // Hann window
     WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
     const float * hann = global_cache.hann_window;
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+    const int pad = frame_size / 2;
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+    // update the samples of the window and their energy
+    // the energy of the last samples before the new ones changes, because their averaging window extends into them
+    {
+        const int hw = 32;
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+        const int64_t n_old = stream.pcm.size();
+        stream.pcm.insert(stream.pcm.end(), samples, samples + n_samples);
+        const int64_t n_cur = stream.pcm.size();
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+        stream.energy.resize(n_cur);
+        for (int64_t i = std::max<int64_t>(0, n_old - hw); i < n_cur; i++) {
+            float sum = 0;
+            for (int64_t j = std::max<int64_t>(0, i - hw); j <= std::min<int64_t>(n_cur - 1, i + hw); j++) {
+                sum += fabs(stream.pcm[j]);
+            }
+            stream.energy[i] = sum/(2*hw + 1);
+        }
+    }
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+    stream.n_samples += n_samples;
+    stream.pending.insert(stream.pending.end(), samples, samples + n_samples);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
+    // reflective pad at the beginning of the stream, as soon as we have enough samples for it
+    if (!stream.has_pad && stream.n_samples > pad) {
+        std::vector<float> padded(pad + stream.pending.size());
+        std::reverse_copy(stream.pending.begin() + 1, stream.pending.begin() + 1 + pad, padded.begin());
+        std::copy(stream.pending.begin(), stream.pending.end(), padded.begin() + pad);
+
+        stream.pending = std::move(padded);
+        stream.has_pad = true;
+    }
+
+    // compute the frames that became final
+    if (stream.has_pad) {
+        const int64_t n_padded = pad + stream.n_samples;
+        const int64_t n_final  = n_padded < frame_size ? 0 : (n_padded - frame_size)/frame_step + 1;
+        const int     n_new    = n_final - stream.n_final;
+
+        if (n_new > 0) {
+            const size_t n_old = stream.frames.size();
+            stream.frames.resize(n_old + (size_t) n_new*n_mel);
+
+            const int n_thread = std::max(1, std::min(n_threads, n_new));
+
+            // maximum of each new frame
+            std::vector<float> mmax_frame(n_new);
+
+            auto worker = [&](int ith) {
+                std::vector<float> fft_in(frame_size, 0.0);
+                std::vector<float> fft_out(frame_size + 2);
+                std::vector<float> fft_work(frame_size * 2);
+
+                for (int i = ith; i < n_new; i += n_thread) {
+                    const float val = log_mel_spectrogram_frame(hann, stream.pending.data() + i*frame_step, frame_size, frame_size,
+                            filters, n_mel, fft_in.data(), fft_out.data(), fft_work.data(), stream.frames.data() + n_old + i*n_mel, 1);
+
+                    mmax_frame[i] = val;
+                }
+            };
+
+            whisper_worker_pool_run(wstate.workers, n_thread, worker);
+
+            for (int i = 0; i < n_new; i++) {
+                while (!stream.mmax.empty() && stream.mmax.back().second <= mmax_frame[i]) {
+                    stream.mmax.pop_back();
+                }
+                stream.mmax.push_back({ stream.n_final + i, mmax_frame[i] });
+            }
+
+            stream.pending.erase(stream.pending.begin(), stream.pending.begin() + (size_t) n_new*frame_step);
+            stream.n_final = n_final;
         }
+    }
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+    // slide the window
+    if (n_keep > 0) {
+        const int64_t n_window = stream.pcm.size();
+        const int64_t n_drop   = std::min<int64_t>(stream.n_final - stream.n_drop, std::max<int64_t>(0, (n_window - n_keep)/frame_step));
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
+        if (n_drop > 0) {
+            stream.frames.erase(stream.frames.begin(), stream.frames.begin() + n_drop*n_mel);
+            stream.pcm   .erase(stream.pcm   .begin(), stream.pcm   .begin() + n_drop*frame_step);
+            stream.energy.erase(stream.energy.begin(), stream.energy.begin() + n_drop*frame_step);
+
+            stream.n_drop += n_drop;
+
+            while (!stream.mmax.empty() && stream.mmax.front().first < stream.n_drop) {
+                stream.mmax.pop_front();
+            }
         }
     }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+    // build the spectrogram of the window, the same way log_mel_spectrogram() would do for its samples
+    const int64_t n_window = stream.pcm.size();
+    const int64_t n_fin    = stream.n_final - stream.n_drop;
+
+    mel.n_mel     = n_mel;
+    mel.n_len     = (n_window + WHISPER_SAMPLE_RATE * 30) / frame_step;
+    mel.n_len_org = 1 + (n_window + pad - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    float mmax = stream.mmax.empty() ? -1e20f : stream.mmax.front().second;
+
+    // final frames
+    for (int64_t i = 0; i < n_fin; i++) {
+        for (int j = 0; j < n_mel; j++) {
+            mel.data[j * mel.n_len + i] = stream.frames[i*n_mel + j];
         }
     }
 
-    mmax -= 8.0;
+    int64_t i = n_fin;
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
+    // frames at the end of the stream, which are zero-padded for now
+    {
+        std::vector<float> padded;
+        if (!stream.has_pad) {
+            padded.resize(pad + stream.pending.size(), 0.0f);
+            for (int k = 0; k < pad; k++) {
+                if (pad - k < (int) stream.pending.size()) {
+                    padded[k] = stream.pending[pad - k];
+                }
+            }
+            std::copy(stream.pending.begin(), stream.pending.end(), padded.begin() + pad);
         }
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        const std::vector<float> & src = stream.has_pad ? stream.pending : padded;
+
+        std::vector<float> fft_in(frame_size, 0.0);
+        std::vector<float> fft_out(frame_size + 2);
+        std::vector<float> fft_work(frame_size * 2);
+
+        for (; i < std::min<int64_t>((n_window + pad) / frame_step + 1, mel.n_len); i++) {
+            const int64_t offset = (i - n_fin)*frame_step;
+
+            const float val = log_mel_spectrogram_frame(hann, src.data() + offset, (int) (src.size() - offset), frame_size,
+                    filters, n_mel, fft_in.data(), fft_out.data(), fft_work.data(), mel.data.data() + i, mel.n_len);
+
+            mmax = std::max(mmax, val);
+        }
     }
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+    // the rest is zero padding
+    if (i < mel.n_len) {
+        const float val = log10f(1e-10f);
+        mmax = std::max(mmax, val);
 
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
+        for (; i < mel.n_len; i++) {
+            for (int j = 0; j < n_mel; j++) {
+                mel.data[j * mel.n_len + i] = val;
+            }
+        }
+    }
+
+    // clamping and normalization
+    {
+        mmax -= 8.0f;
+
+        float * data = mel.data.data();
+        const int n  = mel.n_mel*mel.n_len;
+
+        for (int k = 0; k < n; k++) {
+            data[k] = (std::max(data[k], mmax) + 4.0f)/4.0f;
         }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
     }
 
+    // the samples are not passed to whisper_full() in this mode, so provide the energy for the token timestamps here
+    wstate.energy = stream.energy;
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
     return true;
 }
 
@@ -3396,6 +5296,10 @@ static std::string whisper_openvino_get_path_cache(std::string path_bin) {
 }
 #endif
 
+struct whisper_state * whisper_get_state(struct whisper_context * ctx) {
+    return ctx->state;
+}
+
 struct whisper_state * whisper_init_state(whisper_context * ctx) {
     whisper_state * state = new whisper_state;
 
@@ -3407,8 +5311,7 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
     }
 
     // at this point, we don't know yet how many decoders will be used
-    // later during decoding, if more decoders are used, we will recreate the KV cache respectively
-    state->kv_self_n_dec = 1;
+    // whisper_full() grows the KV cache if more cells are needed
     if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
                 ctx->model.hparams.n_text_state,
                 ctx->model.hparams.n_text_layer,
@@ -3554,6 +5457,11 @@ struct whisper_state * whisper_init_state(whisper_context * ctx) {
 
                     whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
 
+                    // logits are computed only for the requested rows - reserve for one row per decoder
+                    for (int i = 0; i < std::min(n_tokens, WHISPER_MAX_DECODERS); ++i) {
+                        state->batch.logits[n_tokens - 1 - i] = 1;
+                    }
+
                     return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
                 });
 
@@ -3642,6 +5550,10 @@ struct whisper_context_params whisper_context_default_params() {
             /*.heads            =*/ NULL,
         },
         /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.use_mmap             =*/ true,
+        /*.mmap_prefetch        =*/ false,
+        /*.weight_arena_dir     =*/ nullptr,
     };
     return result;
 }
@@ -3654,6 +5566,30 @@ struct whisper_context * whisper_init_from_file_with_params_no_state(const char
     std::wstring path_model_wide = converter.from_bytes(path_model);
     auto fin = std::ifstream(path_model_wide, std::ios::binary);
 #else
+    if (params.use_mmap) {
+        whisper_mmap_reader reader;
+        reader.mapping = whisper_mmap_open(path_model, params.mmap_prefetch);
+
+        if (reader.mapping) {
+            whisper_model_loader loader = {};
+
+            loader.context = &reader;
+            loader.read    = whisper_mmap_reader_read;
+            loader.eof     = whisper_mmap_reader_eof;
+            loader.close   = [](void * /*ctx*/) { };
+
+            auto ctx = whisper_init_with_params_no_state(&loader, params);
+
+            if (ctx) {
+                ctx->path_model = path_model;
+            }
+
+            return ctx;
+        }
+
+        WHISPER_LOG_WARN("%s: failed to map '%s' - falling back to regular reads\n", __func__, path_model);
+    }
+
     auto fin = std::ifstream(path_model, std::ios::binary);
 #endif
     if (!fin) {
@@ -3739,6 +5675,7 @@ struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_
     WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
     WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
     WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: use mmap   = %d\n", __func__, params.use_mmap);
     WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
     WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
 
@@ -3865,10 +5802,62 @@ void whisper_free_state(struct whisper_state * state) {
             state->vad_context = nullptr;
         }
 
+        whisper_free_state(state->draft);
+
         delete state;
     }
 }
 
+struct whisper_batcher * whisper_batcher_init(struct whisper_context * ctx, int n_states_max, int wait_us) {
+    if (n_states_max < 1) {
+        WHISPER_LOG_ERROR("%s: n_states_max must be at least 1\n", __func__);
+        return nullptr;
+    }
+
+    whisper_batcher * batcher = new whisper_batcher;
+
+    batcher->ctx          = ctx;
+    batcher->n_states_max = n_states_max;
+    batcher->wait_us      = std::max(0, wait_us);
+
+    batcher->backends = whisper_backend_init(ctx->params);
+    if (batcher->backends.empty()) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_batcher_free(batcher);
+        return nullptr;
+    }
+
+    const int graph_size = WHISPER_MAX_NODES*n_states_max;
+
+    batcher->sched.sched = ggml_backend_sched_new(batcher->backends.data(), nullptr, batcher->backends.size(), graph_size, false, true);
+    batcher->sched.meta.resize(ggml_tensor_overhead()*graph_size + ggml_graph_overhead_custom(graph_size, false));
+
+    return batcher;
+}
+
+void whisper_batcher_free(struct whisper_batcher * batcher) {
+    if (batcher) {
+        ggml_backend_sched_free(batcher->sched.sched);
+
+        for (auto & backend : batcher->backends) {
+            ggml_backend_free(backend);
+        }
+
+        delete batcher;
+    }
+}
+
+int whisper_state_set_batcher(struct whisper_state * state, struct whisper_batcher * batcher) {
+    if (batcher && batcher->ctx->params.dtw_token_timestamps) {
+        WHISPER_LOG_ERROR("%s: batching is not supported with dtw_token_timestamps\n", __func__);
+        return -1;
+    }
+
+    state->batcher = batcher;
+
+    return 0;
+}
+
 void whisper_free(struct whisper_context * ctx) {
     if (ctx) {
         for (ggml_context * context : ctx->model.ctxs) {
@@ -3879,6 +5868,10 @@ void whisper_free(struct whisper_context * ctx) {
             ggml_backend_buffer_free(buf);
         }
 
+        for (whisper_state * state : ctx->states_pool) {
+            whisper_free_state(state);
+        }
+
         whisper_free_state(ctx->state);
 
         delete ctx;
@@ -3898,6 +5891,9 @@ void whisper_free_params(struct whisper_full_params * params) {
 }
 
 int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->mel_stream = whisper_mel_stream();
+    state->enc_mel_offset = -1;
+
     if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
         WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
         return -1;
@@ -3906,10 +5902,43 @@ int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_s
     return 0;
 }
 
+// the spectrogram of the given ranges of frames only, see log_mel_spectrogram_ranges()
+static int whisper_pcm_to_mel_ranges_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, const std::vector<std::pair<int, int>> & ranges, int n_threads) {
+    state->mel_stream = whisper_mel_stream();
+    state->enc_mel_offset = -1;
+
+    if (!log_mel_spectrogram_ranges(*state, samples, n_samples, ranges, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
 int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
     return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
 }
 
+int whisper_pcm_to_mel_append_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_keep, int n_threads) {
+    if (n_samples < 0 || (n_samples > 0 && samples == nullptr)) {
+        WHISPER_LOG_ERROR("%s: invalid samples\n", __func__);
+        return -1;
+    }
+
+    state->enc_mel_offset = -1;
+
+    if (!log_mel_spectrogram_append(*state, state->mel_stream, samples, n_samples, n_keep, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+int whisper_pcm_to_mel_append(struct whisper_context * ctx, const float * samples, int n_samples, int n_keep, int n_threads) {
+    return whisper_pcm_to_mel_append_with_state(ctx, ctx->state, samples, n_samples, n_keep, n_threads);
+}
+
 int whisper_set_mel_with_state(
         struct whisper_context * ctx,
           struct whisper_state * state,
@@ -3921,6 +5950,9 @@ int whisper_set_mel_with_state(
         return -1;
     }
 
+    state->mel_stream = whisper_mel_stream();
+    state->enc_mel_offset = -1;
+
     state->mel.n_len     = n_len;
     state->mel.n_len_org = n_len;
     state->mel.n_mel     = n_mel;
@@ -3948,6 +5980,45 @@ int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state
     return 0;
 }
 
+int whisper_encode_batch(struct whisper_context * ctx, struct whisper_state ** states, const int * offsets, int n_windows, int n_threads) {
+    if (n_windows <= 0) {
+        return 0;
+    }
+
+    std::vector<whisper_state *> batch_states(states, states + n_windows);
+    std::vector<int>             batch_offsets(offsets, offsets + n_windows);
+
+    const int n_ctx = batch_states[0]->exp_n_audio_ctx;
+
+    bool batched = true;
+    for (int i = 0; i < n_windows; ++i) {
+        if (std::count(batch_states.begin(), batch_states.end(), batch_states[i]) > 1) {
+            WHISPER_LOG_ERROR("%s: each window needs its own state\n", __func__);
+            return -1;
+        }
+
+        // external encoders and mixed audio_ctx values are encoded one window at a time
+        batched = batched && !whisper_encode_external(*batch_states[i]) && batch_states[i]->exp_n_audio_ctx == n_ctx;
+    }
+
+    if (!batched || n_windows == 1) {
+        for (int i = 0; i < n_windows; ++i) {
+            if (whisper_encode_with_state(ctx, batch_states[i], batch_offsets[i], n_threads) != 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
+    if (!whisper_encode_batch_internal(*ctx, batch_states, batch_offsets, n_threads)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
 int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
     if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
         WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
@@ -4061,8 +6132,8 @@ int whisper_lang_auto_detect_with_state(
         return -2;
     }
 
-    // run the encoder
-    if (whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
+    // run the encoder, unless the window has been encoded already
+    if (!whisper_encode_cached(*state, seek) && whisper_encode_with_state(ctx, state, seek, n_threads) != 0) {
         WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
         return -6;
     }
@@ -4300,24 +6371,34 @@ void whisper_print_timings(struct whisper_context * ctx) {
         WHISPER_LOG_INFO("%s:   decode time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_decode_us, n_decode, 1e-3f * ctx->state->t_decode_us / n_decode);
         WHISPER_LOG_INFO("%s:   batchd time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_batchd_us, n_batchd, 1e-3f * ctx->state->t_batchd_us / n_batchd);
         WHISPER_LOG_INFO("%s:   prompt time = %8.2f ms / %5d runs ( %8.2f ms per run)\n", __func__, 1e-3f * ctx->state->t_prompt_us, n_prompt, 1e-3f * ctx->state->t_prompt_us / n_prompt);
+        if (ctx->state->n_drafted > 0) {
+            WHISPER_LOG_INFO("%s:    draft time = %8.2f ms / %5d tokens ( %5d accepted )\n", __func__, 1e-3f * ctx->state->t_draft_us, ctx->state->n_drafted, ctx->state->n_accepted);
+        }
     }
     WHISPER_LOG_INFO("%s:    total time = %8.2f ms\n", __func__, (t_end_us - ctx->t_start_us)/1000.0f);
 }
 
+static void whisper_state_reset_timings(struct whisper_state * state) {
+    state->t_mel_us = 0;
+    state->t_sample_us = 0;
+    state->t_encode_us = 0;
+    state->t_decode_us = 0;
+    state->t_batchd_us = 0;
+    state->t_prompt_us = 0;
+    state->t_draft_us = 0;
+    state->n_sample = 0;
+    state->n_encode = 0;
+    state->n_decode = 0;
+    state->n_batchd = 0;
+    state->n_prompt = 0;
+    state->n_drafted = 0;
+    state->n_accepted = 0;
+}
+
 void whisper_reset_timings(struct whisper_context * ctx) {
     ctx->t_start_us = ggml_time_us();
     if (ctx->state != nullptr) {
-        ctx->state->t_mel_us = 0;
-        ctx->state->t_sample_us = 0;
-        ctx->state->t_encode_us = 0;
-        ctx->state->t_decode_us = 0;
-        ctx->state->t_batchd_us = 0;
-        ctx->state->t_prompt_us = 0;
-        ctx->state->n_sample = 0;
-        ctx->state->n_encode = 0;
-        ctx->state->n_decode = 0;
-        ctx->state->n_batchd = 0;
-        ctx->state->n_prompt = 0;
+        whisper_state_reset_timings(ctx->state);
     }
 }
 
@@ -4431,6 +6512,28 @@ struct whisper_vad_segments {
     std::vector<whisper_vad_segment> data;
 };
 
+// number of chunks that go through the STFT, the encoder and the LSTM input projection in a single graph
+#define WHISPER_VAD_N_BATCH 256
+
+// state of whisper_vad_push_samples() between the calls
+// the segment detection is the one of whisper_vad_segments_from_probs(), run one chunk at a time
+struct whisper_vad_stream {
+    std::vector<float> pending; // samples that do not fill a chunk yet
+
+    int64_t n_chunks = 0; // chunks processed since the reset
+
+    // in samples since the reset
+    bool    is_speech    = false;
+    bool    reported     = false; // the start of the current segment has been reported
+    int64_t speech_start = 0;
+    int64_t temp_end     = 0;
+    int64_t prev_end     = 0;
+    int64_t next_start   = 0;
+    int64_t last_end     = 0;     // end of the last reported segment, the padding of the next one stops there
+
+    std::vector<whisper_vad_event> events; // events of the last push
+};
+
 struct whisper_vad_context {
     int64_t t_vad_us = 0;
 
@@ -4439,16 +6542,27 @@ struct whisper_vad_context {
     int     n_threads;
 
     std::vector<ggml_backend_t> backends;
-    ggml_backend_buffer_t       buffer = nullptr;
     whisper_context_params      params;
-    std::vector<uint8_t>        ctx_buf;
     whisper_sched               sched;
 
     whisper_vad_model    model;
     std::string          path_model;
-    struct ggml_tensor * h_state;
-    struct ggml_tensor * c_state;
     std::vector<float>   probs;
+
+    // the LSTM recurrence runs on the CPU, one chunk at a time - see whisper_vad_lstm_step()
+    std::vector<float> lstm_hh_weight_t; // [4*hdim, hdim] transposed: the weights of h[k] are contiguous
+    std::vector<float> final_conv_weight;
+    float              final_conv_bias = 0.0f;
+
+    std::vector<float> h_state;
+    std::vector<float> c_state;
+    std::vector<float> gates;     // [4*hdim] preactivations of the current step
+    std::vector<float> gates_inp; // [4*hdim, WHISPER_VAD_N_BATCH] input projections computed by the graph
+
+    whisper_vad_stream stream;
+
+    // contexts that share the model, for the shards of whisper_vad_detect_speech_parallel()
+    std::vector<whisper_vad_context *> workers;
 };
 
 struct whisper_vad_context_params whisper_vad_default_context_params(void) {
@@ -4540,20 +6654,37 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_vad_hparams &
     return nullptr;
 }
 
+// ggml_conv_1d() for a batch of inputs: b = [L, IC, N] -> [OL, OC, N]
+// the final reshape of ggml_conv_1d() is only valid for N = 1
+static ggml_tensor * whisper_vad_conv_1d(ggml_context * ctx0, ggml_tensor * a, ggml_tensor * b, int s0, int p0) {
+    struct ggml_tensor * im2col = ggml_im2col(ctx0, a, b, s0, 0, p0, 0, 1, 0, false, GGML_TYPE_F16); // [N, OL, IC * K]
+
+    struct ggml_tensor * cur =
+        ggml_mul_mat(ctx0,
+                ggml_reshape_2d(ctx0, im2col, im2col->ne[0], (im2col->ne[2] * im2col->ne[1])), // [N*OL, IC * K]
+                ggml_reshape_2d(ctx0, a, (a->ne[0] * a->ne[1]), a->ne[2]));                    // [OC, IC * K]
+
+    // [OC, N*OL] => [N, OC, OL]
+    cur = ggml_reshape_3d(ctx0, cur, im2col->ne[1], im2col->ne[2], a->ne[2]);
+    cur = ggml_cont(ctx0, ggml_permute(ctx0, cur, 0, 2, 1, 3));
+
+    return cur;
+}
+
 static ggml_tensor * whisper_vad_build_stft_layer(ggml_context * ctx0,
         const whisper_vad_model & model, ggml_tensor * cur) {
     // Apply reflective padding to the input tensor
     ggml_tensor * padded = ggml_pad_reflect_1d(ctx0, cur, 64, 64);
 
-    struct ggml_tensor * stft = ggml_conv_1d(ctx0, model.stft_forward_basis, padded, model.hparams.lstm_input_size, 0, 1);
+    struct ggml_tensor * stft = whisper_vad_conv_1d(ctx0, model.stft_forward_basis, padded, model.hparams.lstm_input_size, 0);
 
     // Calculate cutoff for real/imaginary parts
     int cutoff = model.stft_forward_basis->ne[2] / 2;
 
     // Extract real part (first half of the STFT output).
-    struct ggml_tensor * real_part = ggml_view_2d(ctx0, stft, 4, cutoff, stft->nb[1], 0);
+    struct ggml_tensor * real_part = ggml_view_3d(ctx0, stft, stft->ne[0], cutoff, stft->ne[2], stft->nb[1], stft->nb[2], 0);
     // Extract imaginary part (second half of the STFT output).
-    struct ggml_tensor * img_part = ggml_view_2d(ctx0, stft, 4, cutoff, stft->nb[1], cutoff * stft->nb[1]);
+    struct ggml_tensor * img_part = ggml_view_3d(ctx0, stft, stft->ne[0], cutoff, stft->ne[2], stft->nb[1], stft->nb[2], cutoff * stft->nb[1]);
 
     // Calculate magnitude: sqrt(real^2 + imag^2)
     struct ggml_tensor * real_squared = ggml_mul(ctx0, real_part, real_part);
@@ -4566,74 +6697,75 @@ static ggml_tensor * whisper_vad_build_stft_layer(ggml_context * ctx0,
 static ggml_tensor * whisper_vad_build_encoder_layer(ggml_context * ctx0,
         const whisper_vad_model & model, ggml_tensor * cur) {
     // First Conv1D: expands to 128 channels.
-    cur = ggml_conv_1d(ctx0, model.encoder_0_weight, cur, 1, 1, 1);
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_0_weight, cur, 1, 1);
     cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_0_bias, 1, 128, 1));
     cur = ggml_relu(ctx0, cur);
 
     // Second Conv1D: reduces to 64 channels.
-    cur = ggml_conv_1d(ctx0, model.encoder_1_weight, cur, 2, 1, 1);
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_1_weight, cur, 2, 1);
     cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_1_bias, 1, 64, 1));
     cur = ggml_relu(ctx0, cur);
 
     // Third Conv1D: maintains 64 channels
-    cur = ggml_conv_1d(ctx0, model.encoder_2_weight, cur, 2, 1, 1);
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_2_weight, cur, 2, 1);
     cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_2_bias, 1, 64, 1));
     cur = ggml_relu(ctx0, cur);
 
     // Fourth Conv1D: expands to 128 channels
-    cur = ggml_conv_1d(ctx0, model.encoder_3_weight, cur, 1, 1, 1);
+    cur = whisper_vad_conv_1d(ctx0, model.encoder_3_weight, cur, 1, 1);
     cur = ggml_add(ctx0, cur, ggml_reshape_3d(ctx0, model.encoder_3_bias, 1, 128, 1));
     cur = ggml_relu(ctx0, cur);
 
     return cur;
 }
 
-static ggml_tensor * whisper_vad_build_lstm_layer(ggml_context * ctx0,
-        const whisper_vad_context & vctx, ggml_tensor * cur, ggml_cgraph * gf) {
-    const whisper_vad_model & model = vctx.model;
-    const int hdim = model.hparams.lstm_hidden_size;
-
-    struct ggml_tensor * x_t = ggml_transpose(ctx0, cur);
-
-    // Create operations using the input-to-hidden weights.
-    struct ggml_tensor * inp_gate = ggml_mul_mat(ctx0, model.lstm_ih_weight, x_t);
-    inp_gate = ggml_add(ctx0, inp_gate, model.lstm_ih_bias);
-
-    // Create operations using the hidden-to-hidden weights.
-    struct ggml_tensor * hid_gate = ggml_mul_mat(ctx0, model.lstm_hh_weight, vctx.h_state);
-    hid_gate = ggml_add(ctx0, hid_gate, model.lstm_hh_bias);
+static inline float whisper_vad_sigmoid(float x) {
+    return 1.0f/(1.0f + expf(-x));
+}
 
-    // Create add operation to get preactivations for all gates.
-    struct ggml_tensor * out_gate = ggml_add(ctx0, inp_gate, hid_gate);
+// one step of the LSTM decoder followed by the final conv, fused into a single pass over the hidden state
+// gx are the input projections of the chunk (W_ih*x + b_ih + b_hh), so only W_hh*h is left to compute here
+// the sum over k runs with the transposed weights, so that the inner loop over the 4*hdim gates gets vectorized
+// returns the speech probability of the chunk
+static float whisper_vad_lstm_step(whisper_vad_context & vctx, const float * gx) {
+    const int hdim = vctx.model.hparams.lstm_hidden_size;
+    const int n_gates = 4*hdim;
 
-    const size_t hdim_size = ggml_row_size(out_gate->type, hdim);
+    float * GGML_RESTRICT g = vctx.gates.data();
+    float * GGML_RESTRICT h = vctx.h_state.data();
+    float * GGML_RESTRICT c = vctx.c_state.data();
 
-    // Create sigmoid for input gate (using the first 128 bytes from the preactivations).
-    struct ggml_tensor * i_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 0 * hdim_size));
+    memcpy(g, gx, n_gates*sizeof(float));
 
-    // Create sigmoid for the forget gate (using the second 128 bytes from the preactivations).
-    struct ggml_tensor * f_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 1 * hdim_size));
+    for (int k = 0; k < hdim; ++k) {
+        const float * GGML_RESTRICT w = vctx.lstm_hh_weight_t.data() + k*n_gates;
+        const float hk = h[k];
 
-    // Create sigmoid for the cell gate (using the third 128 bytes from the preactivations).
-    struct ggml_tensor * g_t = ggml_tanh(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 2 * hdim_size));
+        for (int r = 0; r < n_gates; ++r) {
+            g[r] += w[r]*hk;
+        }
+    }
 
-    // Create sigmoid for the output gate (using the fourth 128 bytes from the preactivations).
-    struct ggml_tensor * o_t = ggml_sigmoid(ctx0, ggml_view_1d(ctx0, out_gate, hdim, 3 * hdim_size));
+    // gates: input, forget, cell, output
+    float sum = vctx.final_conv_bias;
+    for (int j = 0; j < hdim; ++j) {
+        const float i_t = whisper_vad_sigmoid(g[0*hdim + j]);
+        const float f_t = whisper_vad_sigmoid(g[1*hdim + j]);
+        const float g_t = tanhf(g[2*hdim + j]);
+        const float o_t = whisper_vad_sigmoid(g[3*hdim + j]);
 
-    // Update cell state
-    struct ggml_tensor * c_out = ggml_add(ctx0,
-        ggml_mul(ctx0, f_t, vctx.c_state),
-        ggml_mul(ctx0, i_t, g_t));
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, c_out, vctx.c_state));
+        c[j] = f_t*c[j] + i_t*g_t;
+        h[j] = o_t*tanhf(c[j]);
 
-    // Update hidden state
-    struct ggml_tensor * out = ggml_mul(ctx0, o_t, ggml_tanh(ctx0, c_out));
-    ggml_build_forward_expand(gf, ggml_cpy(ctx0, out,   vctx.h_state));
+        sum += vctx.final_conv_weight[j]*std::max(h[j], 0.0f);
+    }
 
-    return out;
+    return whisper_vad_sigmoid(sum);
 }
 
-static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx) {
+// STFT, encoder and LSTM input projection of n_batch chunks (at most WHISPER_VAD_N_BATCH)
+// the chunks do not depend on each other until the LSTM, so they are stacked along the batch dimension
+static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx, int n_batch) {
     const auto & model = vctx.model;
 
     struct ggml_init_params params = {
@@ -4646,26 +6778,27 @@ static struct ggml_cgraph * whisper_vad_build_graph(whisper_vad_context & vctx)
 
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * frame = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, vctx.n_window, 1);
-    ggml_set_name(frame, "frame");
-    ggml_set_input(frame);
+    struct ggml_tensor * frames = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, vctx.n_window, n_batch);
+    ggml_set_name(frames, "frames");
+    ggml_set_input(frames);
 
     struct ggml_tensor * cur = nullptr;
     {
-        cur = whisper_vad_build_stft_layer(ctx0, model, frame);
+        cur = ggml_reshape_3d(ctx0, frames, vctx.n_window, 1, n_batch);
+
+        cur = whisper_vad_build_stft_layer(ctx0, model, cur);
 
         cur = whisper_vad_build_encoder_layer(ctx0, model, cur);
 
-        // Extract the first element of the first dimension
+        // the encoder leaves a single frame per chunk
         // (equivalent to pytorch's [:, :, 0])
-        cur = ggml_view_2d(ctx0, cur, 1, 128, cur->nb[1], 0);
-
-        cur = whisper_vad_build_lstm_layer(ctx0, vctx, cur, gf);
-        cur = ggml_relu(ctx0, cur);
-        cur = ggml_conv_1d(ctx0, model.final_conv_weight, cur, 1, 0, 1);
-        cur = ggml_add(ctx0, cur, model.final_conv_bias);
-        cur = ggml_sigmoid(ctx0, cur);
-        ggml_set_name(cur, "prob");
+        GGML_ASSERT(cur->ne[0] == 1);
+        cur = ggml_reshape_2d(ctx0, cur, cur->ne[1], n_batch);
+
+        cur = ggml_mul_mat(ctx0, model.lstm_ih_weight, cur);
+        cur = ggml_add(ctx0, cur, model.lstm_ih_bias);
+        cur = ggml_add(ctx0, cur, model.lstm_hh_bias);
+        ggml_set_name(cur, "gates");
         ggml_set_output(cur);
     }
 
@@ -4690,40 +6823,40 @@ static bool whisper_vad_init_context(whisper_vad_context * vctx) {
         return false;
     }
 
-    const int32_t lstm_hidden_size = vctx->model.hparams.lstm_hidden_size;
+    const auto & model = vctx->model;
 
-    vctx->ctx_buf.resize(2u*ggml_tensor_overhead());
-
-    struct ggml_init_params params = {
-        /*.mem_size   =*/ vctx->ctx_buf.size(),
-        /*.mem_buffer =*/ vctx->ctx_buf.data(),
-        /*.no_alloc   =*/ true,
-    };
+    const int hdim = model.hparams.lstm_hidden_size;
 
-    ggml_context * ctx = ggml_init(params);
-    if (!ctx) {
-        WHISPER_LOG_ERROR("%s: failed to init LSTM state ggml context\n", __func__);
-        return false;
-    }
+    // host copies of the weights used by the LSTM step
+    {
+        std::vector<float> w(4*hdim*hdim);
+        ggml_backend_tensor_get(model.lstm_hh_weight, w.data(), 0, ggml_nbytes(model.lstm_hh_weight));
 
-    // LSTM Hidden state
-    vctx->h_state = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, lstm_hidden_size);
-    ggml_set_name(vctx->h_state, "h_state");
+        vctx->lstm_hh_weight_t.resize(4*hdim*hdim);
+        for (int r = 0; r < 4*hdim; ++r) {
+            for (int k = 0; k < hdim; ++k) {
+                vctx->lstm_hh_weight_t[k*4*hdim + r] = w[r*hdim + k];
+            }
+        }
 
-    // LSTM Cell state
-    vctx->c_state = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, lstm_hidden_size);
-    ggml_set_name(vctx->c_state, "c_state");
+        std::vector<ggml_fp16_t> w_conv(hdim);
+        ggml_backend_tensor_get(model.final_conv_weight, w_conv.data(), 0, ggml_nbytes(model.final_conv_weight));
 
-    vctx->buffer = ggml_backend_alloc_ctx_tensors(ctx, vctx->backends[0]);
-    if (!vctx->buffer) {
-        WHISPER_LOG_ERROR("%s: failed to allocate memory for the VAD state\n", __func__);
-        return false;
+        vctx->final_conv_weight.resize(hdim);
+        ggml_fp16_to_fp32_row(w_conv.data(), vctx->final_conv_weight.data(), hdim);
+
+        ggml_backend_tensor_get(model.final_conv_bias, &vctx->final_conv_bias, 0, sizeof(float));
     }
 
+    vctx->h_state.assign(hdim, 0.0f);
+    vctx->c_state.assign(hdim, 0.0f);
+    vctx->gates.resize(4*hdim);
+    vctx->gates_inp.resize(4*hdim*WHISPER_VAD_N_BATCH);
+
     {
         bool ok = whisper_sched_graph_init(vctx->sched, vctx->backends,
                 [&]() {
-                    return whisper_vad_build_graph(*vctx);
+                    return whisper_vad_build_graph(*vctx, WHISPER_VAD_N_BATCH);
                 });
 
         if (!ok) {
@@ -5106,6 +7239,73 @@ struct whisper_vad_context * whisper_vad_init_with_params(
     return vctx;
 }
 
+// speech probabilities of the chunks of samples, the last chunk is zero-padded
+// the LSTM state continues from the previous call
+static bool whisper_vad_compute(whisper_vad_context & vctx, const float * samples, int n_samples, float * probs) {
+    const int n_chunks = (n_samples + vctx.n_window - 1)/vctx.n_window;
+    const int n_gates  = 4*vctx.model.hparams.lstm_hidden_size;
+
+    std::vector<float> window;
+
+    auto & sched = vctx.sched.sched;
+
+    ggml_cgraph * gf = nullptr;
+
+    bool ok = true;
+
+    int n_batch = 0;
+
+    for (int i0 = 0; i0 < n_chunks; i0 += WHISPER_VAD_N_BATCH) {
+        const int n_cur = std::min(WHISPER_VAD_N_BATCH, n_chunks - i0);
+
+        // we are going to reuse the graph for all blocks of the same size
+        if (n_cur != n_batch) {
+            n_batch = n_cur;
+
+            ggml_backend_sched_reset(sched);
+
+            gf = whisper_vad_build_graph(vctx, n_batch);
+
+            if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+                WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
+                ok = false;
+                break;
+            }
+
+            window.resize(vctx.n_window*n_batch);
+        }
+
+        struct ggml_tensor * frames = ggml_graph_get_tensor(gf, "frames");
+        struct ggml_tensor * gates  = ggml_graph_get_tensor(gf, "gates");
+
+        const int idx_start = i0*vctx.n_window;
+        const int idx_end   = std::min(idx_start + n_cur*vctx.n_window, n_samples);
+
+        std::copy(samples + idx_start, samples + idx_end, window.begin());
+        std::fill(window.begin() + (idx_end - idx_start), window.end(), 0.0f);
+
+        ggml_backend_tensor_set(frames, window.data(), 0, ggml_nbytes(frames));
+
+        // do not reset the scheduler - we will reuse the graph in the next block
+        if (!ggml_graph_compute_helper(sched, gf, vctx.n_threads, false)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD graph\n", __func__);
+            ok = false;
+            break;
+        }
+
+        ggml_backend_tensor_get(gates, vctx.gates_inp.data(), 0, n_cur*n_gates*sizeof(float));
+
+        // only the recurrence is sequential
+        for (int i = 0; i < n_cur; ++i) {
+            probs[i0 + i] = whisper_vad_lstm_step(vctx, vctx.gates_inp.data() + i*n_gates);
+        }
+    }
+
+    ggml_backend_sched_reset(sched);
+
+    return ok;
+}
+
 bool whisper_vad_detect_speech(
         struct whisper_vad_context * vctx,
         const float * samples,
@@ -5119,75 +7319,333 @@ bool whisper_vad_detect_speech(
     WHISPER_LOG_INFO("%s: n_chunks: %d\n", __func__, n_chunks);
 
     // Reset LSTM hidden/cell states
-    ggml_backend_buffer_clear(vctx->buffer, 0);
+    whisper_vad_stream_reset(vctx);
 
     vctx->probs.resize(n_chunks);
     WHISPER_LOG_INFO("%s: props size: %u\n", __func__, n_chunks);
 
-    std::vector<float> window(vctx->n_window, 0.0f);
+    const int64_t t_start_vad_us = ggml_time_us();
+
+    const bool ok = whisper_vad_compute(*vctx, samples, n_samples, vctx->probs.data());
 
-    auto & sched = vctx->sched.sched;
+    vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
+    WHISPER_LOG_INFO("%s: vad time = %.2f ms processing %d samples\n", __func__, 1e-3f * vctx->t_vad_us, n_samples);
 
-    ggml_cgraph * gf = whisper_vad_build_graph(*vctx);
+    return ok;
+}
 
-    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
-        WHISPER_LOG_ERROR("%s: failed to allocate the compute buffer\n", __func__);
-        return false;
+// a context with its own compute buffers and LSTM state, using the weights of vctx
+static whisper_vad_context * whisper_vad_init_worker(const whisper_vad_context & vctx, int n_threads) {
+    whisper_vad_context * worker = new whisper_vad_context;
+
+    worker->n_window   = vctx.n_window;
+    worker->n_context  = vctx.n_context;
+    worker->n_threads  = n_threads;
+    worker->params     = vctx.params;
+    worker->path_model = vctx.path_model;
+
+    // the tensors are owned by vctx
+    worker->model = vctx.model;
+    worker->model.ctxs.clear();
+    worker->model.buffers.clear();
+
+    if (!whisper_vad_init_context(worker)) {
+        whisper_vad_free(worker);
+        return nullptr;
+    }
+
+    return worker;
+}
+
+bool whisper_vad_detect_speech_parallel(
+        struct whisper_vad_context * vctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_shards,
+                               int   warmup_ms) {
+    const int n_window = vctx->n_window;
+    const int n_chunks = (n_samples + n_window - 1)/n_window;
+    const int n_warmup = (WHISPER_SAMPLE_RATE*warmup_ms/1000 + n_window - 1)/n_window;
+
+    // shards shorter than their warm-up are not worth it
+    n_shards = std::min(n_shards, n_chunks/std::max(1, 2*n_warmup));
+    if (n_shards <= 1) {
+        return whisper_vad_detect_speech(vctx, samples, n_samples);
     }
 
-    struct ggml_tensor * frame = ggml_graph_get_tensor(gf, "frame");
-    struct ggml_tensor * prob  = ggml_graph_get_tensor(gf, "prob");
+    WHISPER_LOG_INFO("%s: detecting speech in %d samples with %d shards (warm-up = %d chunks)\n", __func__, n_samples, n_shards, n_warmup);
+
+    const int n_threads = std::max(1, vctx->n_threads/n_shards);
+
+    while ((int) vctx->workers.size() < n_shards - 1) {
+        whisper_vad_context * worker = whisper_vad_init_worker(*vctx, n_threads);
+        if (worker == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize the VAD context of a shard\n", __func__);
+            return false;
+        }
+        vctx->workers.push_back(worker);
+    }
+
+    whisper_vad_stream_reset(vctx);
+
+    vctx->probs.resize(n_chunks);
 
-    // we are going to reuse the graph multiple times for each chunk
     const int64_t t_start_vad_us = ggml_time_us();
 
-    for (int i = 0; i < n_chunks; i++) {
-        const int idx_start = i * vctx->n_window;
-        const int idx_end = std::min(idx_start + vctx->n_window, n_samples);
+    // shard i computes the chunks [c0, c1), after running the LSTM over the n_warmup chunks before c0
+    auto run = [&](whisper_vad_context * ctx, int i) {
+        const int c0 = (int) (((int64_t) n_chunks*i)/n_shards);
+        const int c1 = (int) (((int64_t) n_chunks*(i + 1))/n_shards);
+        const int cw = std::max(0, c0 - n_warmup);
 
-        const int chunk_len = idx_end - idx_start;
+        whisper_vad_stream_reset(ctx);
 
-        if (chunk_len < vctx->n_window) {
-            WHISPER_LOG_INFO("%s: chunk_len: %d < n_window: %d\n", __func__, chunk_len, vctx->n_window);
-            std::vector<float> partial_chunk(vctx->n_window, 0.0f);
-            std::copy(samples + idx_start, samples + idx_end, partial_chunk.begin());
+        std::vector<float> probs(c1 - cw);
 
-            // Copy the zero-padded chunk to the window.
-            const int samples_to_copy_max = vctx->n_window;
-            const int samples_to_copy_cur = std::min(samples_to_copy_max, (int)partial_chunk.size());
-            std::copy(partial_chunk.begin(), partial_chunk.begin() + samples_to_copy_cur, window.begin());
-            if (samples_to_copy_cur < samples_to_copy_max) {
-                std::fill(window.begin() + samples_to_copy_cur, window.end(), 0.0f);
+        const int i0 = cw*n_window;
+        const int i1 = std::min(c1*n_window, n_samples);
+
+        if (!whisper_vad_compute(*ctx, samples + i0, i1 - i0, probs.data())) {
+            return false;
+        }
+
+        std::copy(probs.begin() + (c0 - cw), probs.end(), vctx->probs.begin() + c0);
+
+        return true;
+    };
+
+    const int n_threads_main = vctx->n_threads;
+    vctx->n_threads = n_threads;
+
+    std::vector<int> rets(n_shards - 1, 0);
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < n_shards; ++i) {
+        whisper_vad_context * worker = vctx->workers[i - 1];
+        worker->n_threads = n_threads;
+
+        threads.emplace_back([&run, &rets, worker, i]() {
+            rets[i - 1] = run(worker, i) ? 0 : 1;
+        });
+    }
+
+    bool ok = run(vctx, 0);
+
+    for (int i = 0; i < n_shards - 1; ++i) {
+        threads[i].join();
+        ok = ok && rets[i] == 0;
+    }
+
+    vctx->n_threads = n_threads_main;
+
+    vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
+    WHISPER_LOG_INFO("%s: vad time = %.2f ms processing %d samples\n", __func__, 1e-3f * vctx->t_vad_us, n_samples);
+
+    return ok;
+}
+
+void whisper_vad_stream_reset(struct whisper_vad_context * vctx) {
+    std::fill(vctx->h_state.begin(), vctx->h_state.end(), 0.0f);
+    std::fill(vctx->c_state.begin(), vctx->c_state.end(), 0.0f);
+
+    vctx->stream = whisper_vad_stream();
+}
+
+static int64_t whisper_vad_samples_to_cs(int64_t n) {
+    return (100*n + WHISPER_SAMPLE_RATE/2)/WHISPER_SAMPLE_RATE;
+}
+
+// report the start of the current segment, padded up to the end of the previous one
+static void whisper_vad_stream_start(whisper_vad_stream & st, int64_t speech_pad_samples) {
+    const int64_t t0 = std::max(st.last_end, st.speech_start - speech_pad_samples);
+
+    st.events.push_back({ WHISPER_VAD_EVENT_SPEECH_START, whisper_vad_samples_to_cs(t0) });
+    st.reported = true;
+}
+
+// end the current segment at sample t1 - segments that are too short are dropped without any event
+// the padded end does not go past t_max
+static void whisper_vad_stream_end(whisper_vad_stream & st, int64_t t1, int64_t min_speech_samples, int64_t speech_pad_samples, int64_t t_max = INT64_MAX) {
+    if (!st.reported && t1 - st.speech_start > min_speech_samples) {
+        whisper_vad_stream_start(st, speech_pad_samples);
+    }
+
+    if (st.reported) {
+        st.last_end = std::min(t1 + speech_pad_samples, t_max);
+        st.events.push_back({ WHISPER_VAD_EVENT_SPEECH_END, whisper_vad_samples_to_cs(st.last_end) });
+    }
+
+    st.reported = false;
+}
+
+// one step of the loop in whisper_vad_segments_from_probs()
+static void whisper_vad_stream_step(whisper_vad_context & vctx, const whisper_vad_params & params, float prob) {
+    auto & st = vctx.stream;
+
+    const int64_t n_window = vctx.n_window;
+    const int64_t sample_rate = WHISPER_SAMPLE_RATE;
+
+    const int64_t min_silence_samples = sample_rate*params.min_silence_duration_ms/1000;
+    const int64_t min_speech_samples  = sample_rate*params.min_speech_duration_ms/1000;
+    const int64_t speech_pad_samples  = sample_rate*params.speech_pad_ms/1000;
+
+    const int64_t max_speech_samples = params.max_speech_duration_s > 100000.0f ? INT64_MAX/2 :
+        std::max<int64_t>(0, (int64_t) (sample_rate*params.max_speech_duration_s) - n_window - 2*speech_pad_samples);
+
+    const int64_t min_silence_samples_at_max_speech = sample_rate*98/1000;
+
+    const float threshold     = params.threshold;
+    const float neg_threshold = std::max(0.01f, threshold - 0.15f);
+
+    const int64_t curr_sample = n_window*st.n_chunks++;
+
+    if (prob >= threshold && st.temp_end) {
+        st.temp_end = 0;
+        if (st.next_start < st.prev_end) {
+            st.next_start = curr_sample;
+        }
+    }
+
+    if (prob >= threshold && !st.is_speech) {
+        st.is_speech    = true;
+        st.speech_start = curr_sample;
+        return;
+    }
+
+    if (!st.is_speech) {
+        return;
+    }
+
+    // split the segments that are too long, at the last pause if there was one
+    if (curr_sample - st.speech_start > max_speech_samples) {
+        if (st.prev_end) {
+            whisper_vad_stream_end(st, st.prev_end, min_speech_samples, speech_pad_samples);
+
+            if (st.next_start < st.prev_end) {
+                st.is_speech = false;
+            } else {
+                st.speech_start = st.next_start;
             }
+            st.prev_end = st.next_start = st.temp_end = 0;
         } else {
-            // Copy current frame samples to the window.
-            const int samples_to_copy = std::min(idx_end - idx_start, vctx->n_window);
-            std::copy(samples + idx_start, samples + idx_start + samples_to_copy, window.begin());
+            whisper_vad_stream_end(st, curr_sample, min_speech_samples, speech_pad_samples);
+
+            st.prev_end = st.next_start = st.temp_end = 0;
+            st.is_speech = false;
+            return;
         }
+    }
 
-        // Set the frame tensor data with the samples.
-        ggml_backend_tensor_set(frame, window.data(), 0, ggml_nelements(frame) * sizeof(float));
+    if (prob < neg_threshold && st.is_speech) {
+        if (!st.temp_end) {
+            st.temp_end = curr_sample;
+        }
 
-        // do not reset the scheduler - we will reuse the graph in the next chunk
-        if (!ggml_graph_compute_helper(sched, gf, vctx->n_threads, false)) {
-            WHISPER_LOG_ERROR("%s: failed to compute VAD graph\n", __func__);
-            break;
+        if (curr_sample - st.temp_end > min_silence_samples_at_max_speech) {
+            st.prev_end = st.temp_end;
         }
 
-        // Get the probability for this chunk.
-        ggml_backend_tensor_get(prob, &vctx->probs[i], 0, sizeof(float));
+        if (curr_sample - st.temp_end >= min_silence_samples) {
+            whisper_vad_stream_end(st, st.temp_end, min_speech_samples, speech_pad_samples);
 
-        //WHISPER_LOG_DEBUG("chunk %d: p = %7.3f\n", i, probs[i]);
+            st.prev_end = st.next_start = st.temp_end = 0;
+            st.is_speech = false;
+            return;
+        }
     }
 
-    vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
-    WHISPER_LOG_INFO("%s: vad time = %.2f ms processing %d samples\n", __func__, 1e-3f * vctx->t_vad_us, n_samples);
+    // the start is reported as soon as the segment is long enough to be kept
+    if (st.is_speech && !st.reported && (st.temp_end ? st.temp_end : curr_sample) - st.speech_start > min_speech_samples) {
+        whisper_vad_stream_start(st, speech_pad_samples);
+    }
+}
 
-    ggml_backend_sched_reset(sched);
+// run the pending samples through the model and the segment detection, the last chunk is zero-padded
+// on failure, the LSTM state is restored so that the samples can be pushed again
+static bool whisper_vad_stream_process(whisper_vad_context & vctx, const whisper_vad_params & params, int n_samples) {
+    auto & st = vctx.stream;
+
+    const int n_chunks = (n_samples + vctx.n_window - 1)/vctx.n_window;
+
+    const std::vector<float> h_state = vctx.h_state;
+    const std::vector<float> c_state = vctx.c_state;
+
+    std::vector<float> probs(n_chunks);
+    if (!whisper_vad_compute(vctx, st.pending.data(), n_samples, probs.data())) {
+        vctx.h_state = h_state;
+        vctx.c_state = c_state;
+        return false;
+    }
+
+    for (int i = 0; i < n_chunks; ++i) {
+        whisper_vad_stream_step(vctx, params, probs[i]);
+    }
+
+    st.pending.erase(st.pending.begin(), st.pending.begin() + n_samples);
 
     return true;
 }
 
+int whisper_vad_push_samples(
+        struct whisper_vad_context * vctx,
+        struct whisper_vad_params    params,
+                       const float * samples,
+                               int   n_samples) {
+    auto & st = vctx->stream;
+
+    st.events.clear();
+    st.pending.insert(st.pending.end(), samples, samples + n_samples);
+
+    const int n_chunks = (int) st.pending.size()/vctx->n_window;
+    if (n_chunks == 0) {
+        return 0;
+    }
+
+    const int64_t t_start_vad_us = ggml_time_us();
+
+    if (!whisper_vad_stream_process(*vctx, params, n_chunks*vctx->n_window)) {
+        return -1;
+    }
+
+    vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
+
+    return (int) st.events.size();
+}
+
+int whisper_vad_flush(
+        struct whisper_vad_context * vctx,
+        struct whisper_vad_params    params) {
+    auto & st = vctx->stream;
+
+    st.events.clear();
+
+    if (!st.pending.empty()) {
+        const int64_t t_start_vad_us = ggml_time_us();
+
+        if (!whisper_vad_stream_process(*vctx, params, st.pending.size())) {
+            return -1;
+        }
+
+        vctx->t_vad_us += ggml_time_us() - t_start_vad_us;
+    }
+
+    // same as the end of the audio in whisper_vad_segments_from_probs()
+    if (st.is_speech) {
+        const int64_t t_end = vctx->n_window*st.n_chunks;
+
+        whisper_vad_stream_end(st, t_end, WHISPER_SAMPLE_RATE*params.min_speech_duration_ms/1000, WHISPER_SAMPLE_RATE*params.speech_pad_ms/1000, t_end);
+
+        st.prev_end = st.next_start = st.temp_end = 0;
+        st.is_speech = false;
+    }
+
+    return (int) st.events.size();
+}
+
+const struct whisper_vad_event * whisper_vad_events(struct whisper_vad_context * vctx) {
+    return vctx->stream.events.data();
+}
+
 int whisper_vad_segments_n_segments(struct whisper_vad_segments * segments) {
     return segments->data.size();
 }
@@ -5473,6 +7931,9 @@ void whisper_vad_free(whisper_vad_context * ctx) {
             ggml_backend_free(backend);
         }
 
+        for (auto * worker : ctx->workers) {
+            whisper_vad_free(worker);
+        }
 
         delete ctx;
     }
@@ -5797,7 +8258,8 @@ static struct whisper_grammar whisper_grammar_init(
     const whisper_grammar_element * pos;
 
     // copy rule definitions into vectors
-    std::vector<std::vector<whisper_grammar_element>> vec_rules(n_rules);
+    auto shared_rules = std::make_shared<std::vector<std::vector<whisper_grammar_element>>>(n_rules);
+    auto & vec_rules  = *shared_rules;
     for (size_t i = 0; i < n_rules; i++) {
         for (pos = rules[i]; pos->type != WHISPER_GRETYPE_END; pos++) {
             vec_rules[i].push_back(*pos);
@@ -5827,7 +8289,7 @@ static struct whisper_grammar whisper_grammar_init(
         }
     } while (true);
 
-    return { std::move(vec_rules), std::move(stacks), {} };
+    return { std::move(shared_rules), std::move(stacks), {} };
 }
 
 static void whisper_suppress_invalid_grammar(
@@ -5836,7 +8298,7 @@ static void whisper_suppress_invalid_grammar(
            std::vector<float> & logits,
     const     whisper_grammar & grammar) {
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.rules->empty() || grammar.stacks.empty()) {
         return;
     }
 
@@ -5861,7 +8323,7 @@ static void whisper_suppress_invalid_grammar(
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = whisper_grammar_reject_candidates(*grammar.rules, grammar.stacks, candidates_grammar);
 
     for (const auto & reject : rejects) {
         logits[reject.id] -= params.grammar_penalty;
@@ -5875,7 +8337,7 @@ static void whisper_suppress_invalid_grammar(
 }
 
 static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.rules->empty() || grammar.stacks.empty()) {
         return;
     }
 
@@ -5893,7 +8355,7 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
     const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
+        grammar.stacks = whisper_grammar_accept(*grammar.rules, grammar.stacks, *it);
     }
     grammar.partial_utf8 = decoded.second;
 }
@@ -6005,6 +8467,13 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.vad_model_path              =*/ nullptr,
 
         /* vad_params =*/ whisper_vad_default_params(),
+
+        /*.vad_seek =*/ false,
+
+        /*.speculative =*/ {
+            /*.ctx     =*/ nullptr,
+            /*.n_draft =*/ 8,
+        },
     };
 
     switch (strategy) {
@@ -6078,83 +8547,366 @@ static int whisper_wrap_segment(struct whisper_context & ctx, struct whisper_sta
             state.result_all.back().tokens.resize(i);
             state.result_all.back().speaker_turn_next = false;
 
-            state.result_all.push_back({});
-            state.result_all.back().t0 = token.t0;
-            state.result_all.back().t1 = segment.t1;
+            state.result_all.push_back({});
+            state.result_all.back().t0 = token.t0;
+            state.result_all.back().t1 = segment.t1;
+
+            // add tokens [i, end] to the new segment
+            state.result_all.back().tokens.insert(
+                state.result_all.back().tokens.end(),
+                    segment.tokens.begin() + i,
+                    segment.tokens.end());
+
+            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+
+            acc = 0;
+            text = "";
+
+            segment = state.result_all.back();
+            i = -1;
+
+            res++;
+        } else {
+            acc += cur;
+            text += txt;
+        }
+    }
+
+    state.result_all.back().text = std::move(text);
+
+    return res;
+}
+
+static const std::vector<std::string> non_speech_tokens = {
+    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
+    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
+    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
+    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
+};
+
+static void whisper_suppress_mask_set(std::vector<uint64_t> & mask, whisper_token id) {
+    mask[id >> 6] |= 1ull << (id & 63);
+}
+
+static void whisper_suppress_mask_set(std::vector<uint64_t> & mask, const whisper_vocab & vocab, const std::string & token) {
+    const auto it = vocab.token_to_id.find(token);
+    if (it != vocab.token_to_id.end()) {
+        whisper_suppress_mask_set(mask, it->second);
+    }
+}
+
+// collect the tokens that are suppressed at every sampling step into the suppress mask of the state:
+// special tokens, suppress_regex matches and non-speech tokens
+// the mask only depends on the vocab and the params, so it is rebuilt only when they change
+static bool whisper_suppress_mask_update(
+              whisper_context & ctx,
+                whisper_state & state,
+    const whisper_full_params & params) {
+    const std::string regex = params.suppress_regex ? params.suppress_regex : "";
+
+    if (state.suppress_mask_valid &&
+        state.suppress_mask_regex == regex &&
+        state.suppress_mask_nst   == params.suppress_nst &&
+        state.suppress_mask_tdrz  == params.tdrz_enable &&
+        state.suppress_mask_no_ts == params.no_timestamps) {
+        return true;
+    }
+
+    const auto & vocab = ctx.vocab;
+
+    std::vector<uint64_t> mask((vocab.n_vocab + 63)/64, 0);
+
+    // suppress <|notimestamps|> token
+    // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
+    whisper_suppress_mask_set(mask, vocab.token_not);
+    if (params.no_timestamps) {
+        for (int i = vocab.token_beg; i < vocab.n_vocab; ++i) {
+            whisper_suppress_mask_set(mask, i);
+        }
+    }
+
+    // suppress sot and nosp tokens
+    whisper_suppress_mask_set(mask, vocab.token_sot);
+    whisper_suppress_mask_set(mask, vocab.token_nosp);
+
+    // [TDRZ] when tinydiarize is disabled, suppress solm token
+    if (params.tdrz_enable == false) {
+        whisper_suppress_mask_set(mask, vocab.token_solm);
+    }
+
+    // suppress task tokens
+    whisper_suppress_mask_set(mask, vocab.token_translate);
+    whisper_suppress_mask_set(mask, vocab.token_transcribe);
+    whisper_suppress_mask_set(mask, vocab.token_prev);
+
+    // suppress lang tokens
+    for (size_t i = 0; i < g_lang.size(); ++i) {
+        whisper_suppress_mask_set(mask, whisper_token_lang(&ctx, i));
+    }
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (!regex.empty()) {
+        try {
+            const std::regex re(regex);
+            for (const auto & token_id : vocab.token_to_id) {
+                if (std::regex_match(token_id.first, re)) {
+                    mask[token_id.second >> 6] |= 1ull << (token_id.second & 63);
+                }
+            }
+        } catch (const std::regex_error & e) {
+            WHISPER_LOG_ERROR("%s: invalid suppress_regex '%s': %s\n", __func__, regex.c_str(), e.what());
+            return false;
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_nst) {
+        for (const std::string & token : non_speech_tokens) {
+            whisper_suppress_mask_set(mask, vocab, token);
+            whisper_suppress_mask_set(mask, vocab, " " + token);
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        whisper_suppress_mask_set(mask, vocab, " -");
+        whisper_suppress_mask_set(mask, vocab, " '");
+    }
+
+    state.suppress_mask       = std::move(mask);
+    state.suppress_mask_regex = regex;
+    state.suppress_mask_nst   = params.suppress_nst;
+    state.suppress_mask_tdrz  = params.tdrz_enable;
+    state.suppress_mask_no_ts = params.no_timestamps;
+    state.suppress_mask_valid = true;
+
+    return true;
+}
+
+static void whisper_suppress_mask_apply(const std::vector<uint64_t> & mask, std::vector<float> & logits) {
+    const int n_logits = logits.size();
+
+    for (int iw = 0; iw < (int) mask.size(); ++iw) {
+        const uint64_t bits = mask[iw];
+        if (bits == 0) {
+            continue;
+        }
+
+        // branchless, so that the compiler can turn it into masked stores
+        float * dst = logits.data() + 64*iw;
+        const int n = std::min(64, n_logits - 64*iw);
+        for (int i = 0; i < n; ++i) {
+            dst[i] = (bits >> i) & 1 ? -INFINITY : dst[i];
+        }
+    }
+}
+
+// exp(x) for x <= 0, returns 0 below -87 (and for -INFINITY)
+// cephes-style range reduction + polynomial, within 2 ulp of expf()
+// the clamping is done with integer selects on the bits: float selects become branches with -ftrapping-math,
+// which would prevent the auto-vectorization of the loops calling this
+static inline float whisper_exp_neg(float x) {
+    const uint32_t keep = x < -87.0f ? 0 : 0xffffffff;
+
+    // xc = max(x, -87)
+    float xc;
+    {
+        const float lo = -87.0f;
+        uint32_t bx;
+        uint32_t bl;
+        memcpy(&bx, &x,  sizeof(bx));
+        memcpy(&bl, &lo, sizeof(bl));
+        bx = (bx & keep) | (bl & ~keep);
+        memcpy(&xc, &bx, sizeof(xc));
+    }
+
+    // r = round(x/ln2), using the 1.5*2^23 trick
+    const float r = (xc*1.44269504088896341f + 12582912.0f) - 12582912.0f;
+    const float g = (xc - r*0.693359375f) + r*2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p*g + 1.3981999507e-3f;
+    p = p*g + 8.3334519073e-3f;
+    p = p*g + 4.1665795894e-2f;
+    p = p*g + 1.6666665459e-1f;
+    p = p*g + 5.0000001201e-1f;
+    p = p*g*g + g + 1.0f;
+
+    // scale by 2^r, r is in [-126, 0], and by 0 below the range
+    const uint32_t bits = ((uint32_t) ((int32_t) r + 127) << 23) & keep;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+
+    return p*scale;
+}
+
+// copy the logits of one row, apply the temperature and the suppress mask in a single pass
+static void whisper_logits_prepare(
+        const float * GGML_RESTRICT src,
+              float * GGML_RESTRICT dst,
+                int   n_logits,
+              float   temperature,
+    const std::vector<uint64_t> & mask) {
+    const float scale = temperature > 0.0f ? 1.0f/temperature : 1.0f;
+
+    for (int iw = 0; iw < (int) mask.size(); ++iw) {
+        const uint64_t bits = mask[iw];
+
+        const float * s = src + 64*iw;
+              float * d = dst + 64*iw;
+        const int n = std::min(64, n_logits - 64*iw);
+
+        if (bits == 0) {
+            for (int i = 0; i < n; ++i) {
+                d[i] = s[i]*scale;
+            }
+        } else {
+            for (int i = 0; i < n; ++i) {
+                d[i] = s[i]*scale;
+            }
+            for (int i = 0; i < n; ++i) {
+                if ((bits >> i) & 1) {
+                    d[i] = -INFINITY;
+                }
+            }
+        }
+    }
+}
 
-            // add tokens [i, end] to the new segment
-            state.result_all.back().tokens.insert(
-                state.result_all.back().tokens.end(),
-                    segment.tokens.begin() + i,
-                    segment.tokens.end());
+// argmax of x[0 .. n), the first index on ties, -1 if all values are -INFINITY
+// the max is computed per block of 64 values with independent lanes, then only the first block reaching it is searched
+static int whisper_logits_argmax(const float * x, int n, float & max) {
+    constexpr int NB = 64;
+    constexpr int NL = 8;
 
-            state.result_all.back().speaker_turn_next = segment.speaker_turn_next;
+    max = -INFINITY;
 
-            acc = 0;
-            text = "";
+    int ib_max = -1;
 
-            segment = state.result_all.back();
-            i = -1;
+    for (int ib = 0; ib < n; ib += NB) {
+        const float * xb = x + ib;
 
-            res++;
+        float mb = -INFINITY;
+        if (n - ib >= NB) {
+            float mv[NL];
+            for (int l = 0; l < NL; ++l) {
+                mv[l] = xb[l];
+            }
+            for (int i = NL; i < NB; i += NL) {
+                for (int l = 0; l < NL; ++l) {
+                    mv[l] = xb[i + l] > mv[l] ? xb[i + l] : mv[l];
+                }
+            }
+            for (int l = 0; l < NL; ++l) {
+                mb = mv[l] > mb ? mv[l] : mb;
+            }
         } else {
-            acc += cur;
-            text += txt;
+            for (int i = 0; i < n - ib; ++i) {
+                mb = xb[i] > mb ? xb[i] : mb;
+            }
+        }
+
+        if (mb > max) {
+            max    = mb;
+            ib_max = ib;
         }
     }
 
-    state.result_all.back().text = std::move(text);
+    if (ib_max < 0) {
+        return -1;
+    }
+
+    int res = ib_max;
+    while (x[res] != max) {
+        ++res;
+    }
 
     return res;
 }
 
-static const std::vector<std::string> non_speech_tokens = {
-    "\"", "#", "(", ")", "*", "+", "/", ":", ";", "<", "=", ">", "@", "[", "\\", "]", "^",
-    "_", "`", "{", "|", "}", "~", "「", "」", "『", "』", "<<", ">>", "<<<", ">>>", "--",
-    "---", "-(", "-[", "('", "(\"", "((", "))", "(((", ")))", "[[", "]]", "{{", "}}", "♪♪",
-    "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
-};
+// probs[i] = exp(x[i] - m), returns the sum
+static float whisper_logits_exp(const float * GGML_RESTRICT x, float * GGML_RESTRICT probs, int n, float m) {
+    constexpr int NL = 8;
 
-static void whisper_compute_logprobs(
-                const std::vector<float> & logits,
-                              const int    n_logits,
-                      std::vector<float> & logprobs) {
-    const float logit_max = *std::max_element(logits.begin(), logits.end());
-    float logsumexp = 0.0f;
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logsumexp += expf(logits[i] - logit_max);
+    float sum[NL] = { 0.0f };
+
+    const int n8 = n - n%NL;
+    for (int i = 0; i < n8; i += NL) {
+        for (int l = 0; l < NL; ++l) {
+            probs[i + l] = whisper_exp_neg(x[i + l] - m);
+            sum[l] += probs[i + l];
         }
     }
-    logsumexp = logf(logsumexp) + logit_max;
+    for (int i = n8; i < n; ++i) {
+        probs[i] = whisper_exp_neg(x[i] - m);
+        sum[i - n8] += probs[i];
+    }
 
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] > -INFINITY) {
-            logprobs[i] = logits[i] - logsumexp;
-        } else {
-            logprobs[i] = -INFINITY;
-        }
+    float res = 0.0f;
+    for (int l = 0; l < NL; ++l) {
+        res += sum[l];
     }
+
+    return res;
 }
 
-static void whisper_compute_probs(
-    const std::vector<float> & logits,
-                  const int    n_logits,
-    const std::vector<float> & logprobs,
-          std::vector<float> & probs)     {
-    for (int i = 0; i < n_logits; ++i) {
-        if (logits[i] == -INFINITY) {
-            probs[i] = 0.0f;
-        } else {
-            probs[i] = expf(logprobs[i]);
+// log_softmax + softmax of the prepared logits, together with the stats needed for sampling
+// if ts_rule is set and the total probability of the timestamps is larger than the probability of any text token,
+// the text tokens are suppressed (the logprobs of the timestamps are not renormalized)
+// ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
+// returns true if the text tokens have been suppressed
+static bool whisper_logits_softmax(
+                      float * GGML_RESTRICT logits,
+                      float * GGML_RESTRICT logprobs,
+                      float * GGML_RESTRICT probs,
+                        int   n_logits,
+                        int   token_beg,
+                       bool   ts_rule,
+       whisper_logits_stats & stats) {
+    float max_text = -INFINITY;
+    float max_ts   = -INFINITY;
+
+    const int id_text = whisper_logits_argmax(logits,             token_beg,            max_text);
+    const int id_ts   = whisper_logits_argmax(logits + token_beg, n_logits - token_beg, max_ts);
+
+    const float m = std::max(max_text, max_ts);
+
+    const float sum_text = whisper_logits_exp(logits,             probs,             token_beg,            m);
+    const float sum_ts   = whisper_logits_exp(logits + token_beg, probs + token_beg, n_logits - token_beg, m);
+
+    const float total = sum_text + sum_ts;
+    const float lse   = m + logf(total);
+    const float scale = 1.0f/total;
+
+    const bool suppress_text = ts_rule && logf(sum_ts) + m > max_text;
+
+    if (suppress_text) {
+        for (int i = 0; i < token_beg; ++i) {
+            logits[i]   = -INFINITY;
+            logprobs[i] = -INFINITY;
+            probs[i]    = 0.0f;
+        }
+    } else {
+        for (int i = 0; i < token_beg; ++i) {
+            logprobs[i] = logits[i] - lse;
+            probs[i]   *= scale;
         }
     }
+    for (int i = token_beg; i < n_logits; ++i) {
+        logprobs[i] = logits[i] - lse;
+        probs[i]   *= scale;
+    }
+
+    stats.tid_max = id_ts >= 0 ? token_beg + id_ts : -1;
+    stats.id_max  = suppress_text || max_ts > max_text ? stats.tid_max : id_text;
+    stats.ptsum   = sum_ts*scale;
+
+    return suppress_text;
 }
 
 // process the logits for the selected decoder
 // - applies logit filters
-// - computes logprobs and probs
-// TODO: optimize
+// - computes logprobs, probs and the stats used for sampling
 static void whisper_process_logits(
               struct whisper_context & ctx,
                struct whisper_state  & state,
@@ -6171,22 +8923,17 @@ static void whisper_process_logits(
 
     // extract the logits for the last token
     // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
+    // the static suppressions (special tokens, suppress_regex, suppress_nst, no_timestamps) are applied while copying
+    // the mask is prepared by whisper_suppress_mask_update() before decoding starts
     auto & probs    = decoder.probs;
     auto & logits   = decoder.logits;
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
-
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
-
-        // will be populated a bit later
         probs.resize(n_logits);
         logprobs.resize(n_logits);
+
+        whisper_logits_prepare(state.logits.data() + decoder.i_batch*n_logits, logits.data(), n_logits, temperature, state.suppress_mask);
     }
 
     // apply logit filters here
@@ -6201,71 +8948,11 @@ static void whisper_process_logits(
             }
         }
 
-        // suppress <|notimestamps|> token
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L410-L412
-        logits[vocab.token_not] = -INFINITY;
-        if (params.no_timestamps) {
-            for (int i = vocab.token_beg; i < n_logits; ++i) {
-                logits[i] = -INFINITY;
-            }
-        }
-
-        // suppress sot and nosp tokens
-        logits[vocab.token_sot]  = -INFINITY;
-        logits[vocab.token_nosp] = -INFINITY;
-
-        // [TDRZ] when tinydiarize is disabled, suppress solm token
-        if (params.tdrz_enable == false) {
-            logits[vocab.token_solm] = -INFINITY;
-        }
-
-        // suppress task tokens
-        logits[vocab.token_translate]  = -INFINITY;
-        logits[vocab.token_transcribe] = -INFINITY;
-        logits[vocab.token_prev]       = -INFINITY;
-
-        // suppress lang tokens
-        for (size_t i = 0; i < g_lang.size(); ++i) {
-            logits[whisper_token_lang(&ctx, i)] = -INFINITY;
-        }
-
-        // suppress prev token
-        logits[vocab.token_prev] = -INFINITY;
-
         if (params.logits_filter_callback) {
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
-        }
-
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
 
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+            // the callback must not bring back the suppressed tokens
+            whisper_suppress_mask_apply(state.suppress_mask, logits);
         }
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
@@ -6278,13 +8965,9 @@ static void whisper_process_logits(
 
             if (last_was_timestamp) {
                 if (penultimate_was_timestamp) {
-                    for (int i = vocab.token_beg; i < n_logits; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
                 } else {
-                    for (int i = 0; i < vocab.token_eot; ++i) {
-                        logits[i] = -INFINITY;
-                    }
+                    std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
                 }
             }
         }
@@ -6310,67 +8993,17 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
-
+        // populate the logprobs and probs arrays (log_softmax + softmax)
         // if sum of probability over timestamps is above any other token, sample timestamp
-        // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
-        {
-            // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+        const bool ts_only = whisper_logits_softmax(logits.data(), logprobs.data(), probs.data(), n_logits, vocab.token_beg, true, decoder.stats);
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
-
-            //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
-
-            if (timestamp_logprob > max_text_token_logprob) {
-                for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
-                }
-            } else {
-                if (params.n_grammar_rules > 0) {
-                    whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
-
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
+        if (!ts_only && params.n_grammar_rules > 0) {
+            whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
-                }
-            }
+            whisper_logits_softmax(logits.data(), logprobs.data(), probs.data(), n_logits, vocab.token_beg, false, decoder.stats);
         }
     }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
-
 #if 0
     // print first 100 logits - token string : logit
     //for (int i = 0; i < 10; i++) {
@@ -6450,37 +9083,18 @@ static whisper_token_data whisper_sample_token(
 
     const auto & probs    = decoder.probs;
     const auto & logprobs = decoder.logprobs;
+    const auto & stats    = decoder.stats;
 
-    const int n_logits = vocab.n_vocab;
-
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
-
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
-
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                result.tid = i;
-            }
-        }
-
-        result.pt    = max_ts/(sum_ts + 1e-10);
-        result.ptsum = sum_ts;
+    if (stats.tid_max >= 0) {
+        result.tid = stats.tid_max;
+        result.pt  = probs[stats.tid_max]/(stats.ptsum + 1e-10);
     }
+    result.ptsum = stats.ptsum;
 
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
-        }
+        result.id   = stats.id_max;
+        result.p    = probs[stats.id_max];
+        result.plog = logprobs[stats.id_max];
     } else {
         std::discrete_distribution<> dist(probs.begin(), probs.end());
 
@@ -6504,61 +9118,38 @@ static std::vector<whisper_token_data> whisper_sample_token_topk(
     const auto & vocab = ctx.vocab;
 
     const auto & probs    = decoder.probs;
-    const auto & logits   = decoder.logits;
     const auto & logprobs = decoder.logprobs;
 
-    const int n_logits = vocab.n_vocab;
-
-    auto & logits_id = decoder.logits_id;
-
-    logits_id.resize(n_logits);
-    for (int i = 0; i < n_logits; ++i) {
-        logits_id[i].first = logits[i];
-        logits_id[i].second = i;
-    }
-
-    {
-        using pair_type = std::remove_reference<decltype(logits_id)>::type::value_type;
-        std::partial_sort(
-                logits_id.begin(),
-                logits_id.begin() + k, logits_id.end(),
-                [](const pair_type & a, const pair_type & b) {
-            return a.first > b.first;
-        });
-    }
-
     std::vector<whisper_token_data> result;
     result.reserve(k);
 
-    whisper_token tid = vocab.token_beg;
+    const auto & stats = decoder.stats;
 
-    float pt    = 0.0;
-    float ptsum = 0.0;
+    const whisper_token tid = stats.tid_max >= 0 ? stats.tid_max : vocab.token_beg;
 
-    {
-        double sum_ts = 0.0;
-        double max_ts = 0.0;
+    const float pt    = stats.tid_max >= 0 ? probs[stats.tid_max]/(stats.ptsum + 1e-10) : 0.0f;
+    const float ptsum = stats.ptsum;
 
-        for (int i = vocab.token_beg; i < n_logits; i++) {
-            if (probs[i] == -INFINITY) {
-                continue;
-            }
+    // the k candidates are drawn by inverse transform sampling from the cumulative probs - unlike
+    // std::discrete_distribution, this needs no normalized copy of the probs and no allocations
+    auto & probs_cum = decoder.probs_cum;
 
-            sum_ts += probs[i];
-            if (max_ts < probs[i]) {
-                max_ts = probs[i];
-                tid = i;
-            }
-        }
+    const int n_vocab = probs.size();
+
+    probs_cum.resize(n_vocab);
 
-        pt    = max_ts/(sum_ts + 1e-10);
-        ptsum = sum_ts;
+    double sum = 0.0;
+    for (int i = 0; i < n_vocab; ++i) {
+        sum += probs[i];
+        probs_cum[i] = sum;
     }
 
-    std::discrete_distribution<> dist(probs.begin(), probs.end());
+    std::uniform_real_distribution<double> dist(0.0, 1.0);
 
     for (int i = 0; i < k; ++i) {
-        const auto id = dist(decoder.rng);
+        const double u = dist(decoder.rng)*sum;
+
+        const whisper_token id = std::min<int>(std::upper_bound(probs_cum.begin(), probs_cum.end(), u) - probs_cum.begin(), n_vocab - 1);
         //printf("XXX %d %d %f %f %f %f\n", id, tid, probs[id], logprobs[id], pt, ptsum);
 
         result.push_back({ id, tid, probs[id], logprobs[id], pt, ptsum, -1, -1, -1, 0.0f, });
@@ -6621,8 +9212,66 @@ static void whisper_sequence_score(
     }
 }
 
+// the VAD context of the state, created on first use
+static whisper_vad_context * whisper_vad_context_from_state(whisper_state * state, const whisper_full_params & params) {
+    if (state->vad_context == nullptr) {
+        struct whisper_vad_context_params vad_ctx_params = whisper_vad_default_context_params();
+        struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(params.vad_model_path, vad_ctx_params);
+        if (vctx == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize VAD context\n", __func__);
+            return nullptr;
+        }
+        state->vad_context = vctx;
+    }
+
+    return state->vad_context;
+}
+
+// [EXPERIMENTAL] VAD-driven seek (params.vad_seek)
+// only the speech segments are stored - the seek loop of whisper_full_internal() jumps over the silence between them,
+// so the audio is not copied and the timestamps refer to the original audio
+static bool whisper_vad_seek_segments(
+          struct whisper_state * state,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    state->vad_seek_segments.clear();
+    state->vad_mapping_table.clear();
+    state->has_vad_segments = false;
+
+    auto vctx = whisper_vad_context_from_state(state, params);
+    if (vctx == nullptr) {
+        return false;
+    }
+
+    whisper_vad_segments * vad_segments = whisper_vad_segments_from_samples(vctx, params.vad_params, samples, n_samples);
+    if (vad_segments == nullptr) {
+        return false;
+    }
+
+    // same extension of the segments as the one used when building the filtered audio
+    const int n_overlap = (int) (100*params.vad_params.samples_overlap);
+
+    const int n_segments = (int) vad_segments->data.size();
+    for (int i = 0; i < n_segments; ++i) {
+        const int t0 = (int) vad_segments->data[i].start;
+        const int t1 = (int) vad_segments->data[i].end + (i < n_segments - 1 ? n_overlap : 0);
+
+        if (!state->vad_seek_segments.empty() && t0 <= state->vad_seek_segments.back().second) {
+            state->vad_seek_segments.back().second = std::max(state->vad_seek_segments.back().second, t1);
+        } else {
+            state->vad_seek_segments.push_back({ t0, t1 });
+        }
+    }
+
+    whisper_vad_free_segments(vad_segments);
+
+    WHISPER_LOG_INFO("%s: detected %d speech segments\n", __func__, (int) state->vad_seek_segments.size());
+
+    return true;
+}
+
 static bool whisper_vad(
-        struct whisper_context * ctx,
           struct whisper_state * state,
     struct whisper_full_params   params,
                    const float * samples,
@@ -6635,16 +9284,10 @@ static bool whisper_vad(
     state->vad_mapping_table.clear();
     state->has_vad_segments = false;
 
-    if (state->vad_context == nullptr) {
-        struct whisper_vad_context_params vad_ctx_params = whisper_vad_default_context_params();
-        struct whisper_vad_context * vctx = whisper_vad_init_from_file_with_params(params.vad_model_path, vad_ctx_params);
-        if (vctx == nullptr) {
-            WHISPER_LOG_ERROR("%s: failed to initialize VAD context\n", __func__);
-            return false;
-        }
-        state->vad_context = vctx;
+    auto vctx = whisper_vad_context_from_state(state, params);
+    if (vctx == nullptr) {
+        return false;
     }
-    auto vctx = state->vad_context;
 
     const whisper_vad_params & vad_params = params.vad_params;
 
@@ -6652,8 +9295,8 @@ static bool whisper_vad(
 
     if (vad_segments->data.size() > 0) {
         state->has_vad_segments = true;
-        ctx->state->vad_segments.clear();
-        ctx->state->vad_segments.reserve(vad_segments->data.size());
+        state->vad_segments.clear();
+        state->vad_segments.reserve(vad_segments->data.size());
 
         // Initialize the time mapping table
         state->vad_mapping_table.clear();
@@ -6749,7 +9392,7 @@ static bool whisper_vad(
 
                 WHISPER_LOG_INFO("%s: vad_segment_info: orig_start: %.2f, orig_end: %.2f, vad_start: %.2f, vad_end: %.2f\n",
                     __func__, segment.orig_start/100.0, segment.orig_end/100.0, segment.vad_start/100.0, segment.vad_end/100.0);
-                ctx->state->vad_segments.push_back(segment);
+                state->vad_segments.push_back(segment);
 
                 // Copy this speech segment
                 memcpy(filtered_samples.data() + offset, samples + segment_start_samples, segment_length * sizeof(float));
@@ -6801,30 +9444,144 @@ static bool whisper_vad(
     return true;
 }
 
-int whisper_full_with_state(
+// [EXPERIMENTAL] adaptive audio context (audio_ctx < 0)
+// the encoder only needs the mel frames that contain audio (2 per audio context frame) and a short margin of silence
+// the context is rounded up to a bucket, so that only a few distinct encoder graphs are used - they all fit in the
+// buffers reserved for the full context. with flash attention the bucket is the padding of the cross-attention
+// KV cache, so that the decoder does not attend padded cells
+// returns 0 (use the full context) if the rounded context is not smaller than the one of the model
+static int whisper_audio_ctx_adaptive(const whisper_context & ctx, int n_frames) {
+    const int n_bucket = ctx.params.flash_attn ? 256 : 128;
+    const int n_ctx    = GGML_PAD((n_frames + 1)/2 + WHISPER_AUDIO_CTX_MARGIN, n_bucket);
+
+    return n_ctx < ctx.model.hparams.n_audio_ctx ? n_ctx : 0;
+}
+
+static void whisper_audio_ctx_set(whisper_context & ctx, whisper_state & state, int n_ctx) {
+    // with flash attention the padded cells of the cross-attention KV cache are attended - do not leave there the
+    // data of another layout
+    if (ctx.params.flash_attn && n_ctx != state.exp_n_audio_ctx) {
+        ggml_backend_buffer_clear(state.kv_cross.buffer, 0);
+        state.enc_mel_offset = -1;
+    }
+
+    state.exp_n_audio_ctx = n_ctx;
+}
+
+// speculative decoding: propose up to n_draft tokens that follow the tokens of `decoder`, with the draft model
+// the draft decoder applies the same logit filters as the greedy decoder of the main model, so that most drafts are accepted
+// the KV cache of the draft state holds the tokens in `past` - only the tokens after the common prefix are decoded
+static bool whisper_speculative_draft(
+                   whisper_context & ctx_draft,
+                     whisper_state & dstate,
+         const whisper_full_params & params,
+             const whisper_decoder & decoder,
+  const std::vector<whisper_token> & tokens,
+        std::vector<whisper_token> & past,
+                               int   n_draft,
+        std::vector<whisper_token> & draft) {
+    draft.clear();
+
+    // the last token is always decoded, to obtain the logits that follow it
+    size_t n_keep = 0;
+    while (n_keep < past.size() && n_keep + 1 < tokens.size() && past[n_keep] == tokens[n_keep]) {
+        n_keep++;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_keep, -1);
+    past.resize(n_keep);
+
+    auto & ddecoder = dstate.decoders[0];
+
+    ddecoder.sequence.tokens = decoder.sequence.tokens;
+    ddecoder.seek_delta      = decoder.seek_delta;
+    ddecoder.has_ts          = decoder.has_ts;
+
+    whisper_token id = -1;
+
+    for (int i = 0; i < n_draft; ++i) {
+        const whisper_token * inp   = i == 0 ? tokens.data() + n_keep : &id;
+        const int             n_inp = i == 0 ? tokens.size() - n_keep : 1;
+
+        whisper_batch_prep_legacy(dstate.batch, inp, n_inp, past.size(), 0);
+
+        if (!whisper_decode_internal(ctx_draft, dstate, dstate.batch, params.n_threads, false, nullptr, nullptr)) {
+            return false;
+        }
+
+        past.insert(past.end(), inp, inp + n_inp);
+
+        ddecoder.i_batch = n_inp - 1;
+
+        whisper_process_logits(ctx_draft, dstate, ddecoder, params, 0.0f);
+
+        const whisper_token_data token = whisper_sample_token(ctx_draft, ddecoder, true);
+
+        id = token.id;
+
+        draft.push_back(id);
+        ddecoder.sequence.tokens.push_back(token);
+
+        if (id == whisper_token_eot(&ctx_draft)) {
+            break;
+        }
+
+        if (id > whisper_token_beg(&ctx_draft)) {
+            ddecoder.seek_delta = 2*(id - whisper_token_beg(&ctx_draft));
+            ddecoder.has_ts     = true;
+        }
+    }
+
+    return true;
+}
+
+// with has_mel, the spectrogram of the samples is already in the state (see whisper_full_parallel())
+static int whisper_full_internal(
         struct whisper_context * ctx,
           struct whisper_state * state,
     struct whisper_full_params   params,
                    const float * samples,
-                           int   n_samples) {
+                           int   n_samples,
+                          bool   has_mel = false) {
     // clear old results
     auto & result_all = state->result_all;
 
     result_all.clear();
 
-    if (n_samples > 0) {
+    if (n_samples > 0 && !has_mel) {
         // compute log mel spectrogram
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+        // with params.vad_seek, only the speech segments are computed, directly from the original audio
+        const int ret = params.vad && params.vad_seek ?
+            whisper_pcm_to_mel_ranges_with_state(ctx, state, samples, n_samples, state->vad_seek_segments, params.n_threads) :
+            whisper_pcm_to_mel_with_state       (ctx, state, samples, n_samples, params.n_threads);
+
+        if (ret != 0) {
             WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
             return -2;
         }
     }
 
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+
+    // set before the language detection, so that its encoder pass can be reused for the first window
+    if (params.audio_ctx >= 0) {
+        whisper_audio_ctx_set(*ctx, *state, params.audio_ctx);
+    } else {
+        whisper_audio_ctx_set(*ctx, *state, whisper_audio_ctx_adaptive(*ctx, whisper_n_len_from_state(state)));
+    }
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        // with params.vad_seek, detect the language on the first speech segment
+        const int offset_ms = params.vad && params.vad_seek && !state->vad_seek_segments.empty() ? 10*state->vad_seek_segments[0].first : 0;
+
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, offset_ms, params.n_threads, probs.data());
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
@@ -6901,11 +9658,14 @@ int whisper_full_with_state(
         decoder.probs.resize   (ctx->vocab.n_vocab);
         decoder.logits.resize  (ctx->vocab.n_vocab);
         decoder.logprobs.resize(ctx->vocab.n_vocab);
-        decoder.logits_id.reserve(ctx->model.hparams.n_vocab);
 
         decoder.rng = std::mt19937(j);
     }
 
+    if (!whisper_suppress_mask_update(*ctx, *state, params)) {
+        return -10;
+    }
+
     // the accumulated text context so far
     auto & prompt_past = state->prompt_past;
     if (params.no_context) {
@@ -6934,17 +9694,10 @@ int whisper_full_with_state(
             // parse tokens from the pointer
             for (int i = 0; i < params.prompt_n_tokens; i++) {
                 prompt_past.push_back(params.prompt_tokens[i]);
-            }
-            std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
-        }
-    }
-
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
+            }
+            std::rotate(prompt_past.begin(), prompt_past.end() - params.prompt_n_tokens, prompt_past.end());
+        }
     }
-    state->exp_n_audio_ctx = params.audio_ctx;
 
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
@@ -6978,21 +9731,167 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // a candidate is the sequence of a decoder extended by one token
+    // the sequence and the grammar of the decoder are copied only for the selected candidates
     struct beam_candidate {
         int decoder_idx;
         int seek_delta;
 
         bool has_ts;
 
-        whisper_sequence sequence;
-        whisper_grammar grammar;
+        whisper_token_data token;
+
+        double sum_logprobs_all;
     };
 
+    // the selected candidate of each decoder
+    std::vector<int> beam_selected(n_decoders);
+    std::vector<int> beam_n_uses  (n_decoders);
+
+    std::vector<whisper_sequence> beam_sequences(n_decoders);
+    std::vector<whisper_grammar>  beam_grammars (n_decoders);
+
     std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
     std::vector<beam_candidate> beam_candidates;
 
+    // speculative decoding - only the greedy decoder at temperature 0 uses it
+    // the batched text-generation steps of a batcher already share the weight sweeps, so it is not combined with it
+    whisper_context * ctx_draft = params.speculative.ctx;
+
+    const int n_draft = params.speculative.n_draft;
+
+    // the draft model does not use the grammar and the logits filter callback - the verification takes care of them
+    whisper_full_params params_draft = params;
+    params_draft.logits_filter_callback = nullptr;
+    params_draft.grammar_rules          = nullptr;
+    params_draft.n_grammar_rules        = 0;
+
+    if (ctx_draft != nullptr && (n_draft <= 0 || state->batcher != nullptr || params.strategy != WHISPER_SAMPLING_GREEDY)) {
+        ctx_draft = nullptr;
+    }
+
+    if (ctx_draft != nullptr && ctx_draft->vocab.n_vocab != ctx->vocab.n_vocab) {
+        WHISPER_LOG_WARN("%s: the draft model has a different vocabulary (%d != %d) - speculative decoding disabled\n", __func__, ctx_draft->vocab.n_vocab, ctx->vocab.n_vocab);
+        ctx_draft = nullptr;
+    }
+
+    if (ctx_draft != nullptr && n_samples <= 0 && ctx_draft->model.filters.n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_WARN("%s: the draft model needs the PCM samples to compute its mel spectrogram - speculative decoding disabled\n", __func__);
+        ctx_draft = nullptr;
+    }
+
+    if (ctx_draft != nullptr) {
+        if (state->draft != nullptr && state->draft_ctx != ctx_draft) {
+            whisper_free_state(state->draft);
+            state->draft = nullptr;
+        }
+
+        if (state->draft == nullptr) {
+            state->draft = whisper_init_state(ctx_draft);
+            if (state->draft == nullptr) {
+                WHISPER_LOG_ERROR("%s: failed to create the state of the draft model\n", __func__);
+                return -11;
+            }
+            state->draft_ctx = ctx_draft;
+        }
+
+        if (ctx_draft->model.filters.n_mel == ctx->model.filters.n_mel) {
+            state->draft->mel = state->mel;
+            state->draft->enc_mel_offset = -1;
+        } else if (whisper_pcm_to_mel_with_state(ctx_draft, state->draft, samples, n_samples, params.n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram for the draft model\n", __func__);
+            return -2;
+        }
+
+        if (!whisper_suppress_mask_update(*ctx_draft, *state->draft, params_draft)) {
+            return -10;
+        }
+    }
+
+    // size the self-attention KV cache by the number of tokens that can be live at the same time
+    // the cells are allocated one by one, so the decoders only share the cells of the prompt and there is no fragmentation:
+    //  - the prompt with the past text, and the initial prompt used by the fallbacks with t >= 0.5
+    //  - up to n_text_ctx/2 generated tokens per decoder
+    //  - the drafted tokens that are not verified yet
+    {
+        const int n_text_ctx = ctx->model.hparams.n_text_ctx;
+        const int n_prompt   = std::min(n_text_ctx, n_text_ctx/2 + 1 + (int) prompt_init.size());
+        const int n_kv       = GGML_PAD(n_prompt + (int) prompt_init.size() + n_decoders*(n_text_ctx/2) + (ctx_draft ? n_draft : 0), 256);
+
+        if ((int) state->kv_self.size < n_kv) {
+            WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders = %d, n_kv = %d\n", __func__, n_decoders, n_kv);
+
+            whisper_kv_cache_free(state->kv_self);
+
+            if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                        ctx->model.hparams.n_text_state,
+                        ctx->model.hparams.n_text_layer,
+                        n_kv)) {
+                WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+                whisper_free_state(state);
+                return -7;
+            }
+        }
+    }
+
+    // the prompts prefilled for the current window
+    // their KV cells are kept under the sequence WHISPER_KV_SEQ_PROMPT + i, so that the temperature fallbacks
+    // only copy them to the decoders instead of decoding the prompt again
+    struct prompt_entry {
+        std::vector<whisper_token> tokens; // empty if not used
+
+        std::vector<float> logits; // logits of the last prompt token
+        float no_speech_prob;
+    };
+
+    prompt_entry prompt_cache[WHISPER_KV_N_PROMPT];
+
+    // speculative decoding
+    // the main model decodes the last sampled token together with the drafted tokens that follow it (the rows)
+    // while the sampled tokens match the drafted ones, the logits of the next row are used without decoding again
+    struct speculative_state {
+        bool encoded = false; // the current window has been encoded by the draft model
+
+        std::vector<whisper_token> tokens; // the prompt and the generated tokens - the input of the draft model
+        std::vector<whisper_token> past;   // the tokens in the KV cache of the draft model
+        std::vector<whisper_token> draft;
+        std::vector<whisper_token> rows;
+
+        int i_row = 0; // the row used for the last sampled token
+    };
+
+    speculative_state spec;
+
+    // the speech segments that drive the seek loop (params.vad_seek), empty to process all of the audio
+    const std::vector<std::pair<int, int>> speech = params.vad && params.vad_seek ? state->vad_seek_segments : std::vector<std::pair<int, int>>();
+
+    int i_speech = 0;
+
     // main loop
     while (true) {
+        // the end of the audio for the current window - with params.vad_seek, this is the end of the last speech
+        // segment that starts inside the window
+        int seek_end_win = seek_end;
+
+        if (!speech.empty()) {
+            // skip the segments that have been transcribed
+            while (i_speech < (int) speech.size() && speech[i_speech].second <= seek + delta_min) {
+                ++i_speech;
+            }
+            if (i_speech == (int) speech.size()) {
+                break;
+            }
+
+            // skip the silence before the next segment without encoding it
+            seek = std::max(seek, speech[i_speech].first);
+
+            int j = i_speech;
+            while (j + 1 < (int) speech.size() && speech[j + 1].first < seek + 100*WHISPER_CHUNK_SIZE) {
+                ++j;
+            }
+            seek_end_win = std::min(seek_end, speech[j].second);
+        }
+
         if (params.progress_callback) {
             const int progress_cur = (100*(seek - seek_start))/(seek_end - seek_start);
 
@@ -7012,8 +9911,15 @@ int whisper_full_with_state(
             }
         }
 
+        if (params.audio_ctx < 0) {
+            whisper_audio_ctx_set(*ctx, *state, whisper_audio_ctx_adaptive(*ctx, seek_end_win - seek));
+        }
+
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // the first window is usually encoded already by the language detection
+        if (whisper_encode_cached(*state, seek)) {
+            WHISPER_LOG_DEBUG("%s: reusing the encoded window at seek = %d\n", __func__, seek);
+        } else if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -7024,6 +9930,13 @@ int whisper_full_with_state(
             prompt_past.clear();
         }
 
+        // new audio features - the prompts have to be decoded again
+        for (auto & entry : prompt_cache) {
+            entry.tokens.clear();
+        }
+
+        spec.encoded = false;
+
         int best_decoder_id = 0;
 
         for (int it = 0; it < (int) temperatures.size(); ++it) {
@@ -7050,6 +9963,11 @@ int whisper_full_with_state(
 
             n_decoders_cur = std::max(1, n_decoders_cur);
 
+            bool speculative = ctx_draft != nullptr && n_decoders_cur == 1 && t_cur < 1e-6f;
+
+            spec.rows.clear();
+            spec.i_row = 0;
+
             WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
 
             // TAGS: WHISPER_DECODER_INIT
@@ -7078,7 +9996,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -7100,53 +10017,92 @@ int whisper_full_with_state(
                 }
                 WHISPER_LOG_DEBUG("\n\n");
 
-                // recreate the KV cache if the number of decoders has changed
-                if (state->kv_self_n_dec < n_decoders_cur) {
-                    WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders_cur = %d\n", __func__, n_decoders_cur);
-
-                    whisper_kv_cache_free(state->kv_self);
+                const int n_logits = ctx->vocab.id_to_token.size();
 
-                    // overallocate to workaround KV cache fragmentation issues
-                    const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
+                int i_entry = -1;
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
-                                ctx->model.hparams.n_text_state,
-                                ctx->model.hparams.n_text_layer,
-                                GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
-                        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-                        whisper_free_state(state);
-                        return -7;
+                uint64_t keep = 0;
+                for (int e = 0; e < WHISPER_KV_N_PROMPT; ++e) {
+                    if (prompt_cache[e].tokens.empty()) {
+                        continue;
+                    }
+                    if (prompt_cache[e].tokens == prompt) {
+                        i_entry = e;
                     }
+                    keep |= whisper_kv_seq_bit(WHISPER_KV_SEQ_PROMPT + e);
+                }
 
-                    state->kv_self_n_dec = n_decoders_cur;
+                if (keep == 0) {
+                    whisper_kv_cache_clear(state->kv_self);
+                } else {
+                    // drop the sequences of the previous attempt
+                    whisper_kv_cache_seq_keep(state->kv_self, keep);
                 }
 
-                whisper_kv_cache_clear(state->kv_self);
+                if (i_entry >= 0) {
+                    const auto & entry = prompt_cache[i_entry];
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                    whisper_kv_cache_seq_cp(state->kv_self, WHISPER_KV_SEQ_PROMPT + i_entry, 0, -1, -1);
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
-                    WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
-                    return -8;
-                }
+                    state->logits.resize(std::max(state->logits.size(), entry.logits.size()));
+                    std::copy(entry.logits.begin(), entry.logits.end(), state->logits.begin());
 
-                // Calculate no_speech probability after first decode.
-                // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
-                {
-                    const int n_logits = ctx->vocab.id_to_token.size();
-                    std::vector<float> logprobs(n_logits);
-                    std::vector<float> probs(n_logits);
+                    state->no_speech_prob      = entry.no_speech_prob;
+                    state->decoders[0].i_batch = 0;
+                } else {
+                    // the SOT token is the first token of prompt_init
+                    const int i_sot = prompt.size() - prompt_init.size();
+
+                    whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+
+                    // the logits of the SOT token are needed for the no_speech probability
+                    state->batch.logits[i_sot] = 1;
+
+                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                        WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                        return -8;
+                    }
+
+                    const float * logits = state->logits.data() + (prompt.size() - 1)*n_logits;
+
+                    // Calculate no_speech probability after first decode.
+                    // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
+                    // ref: https://github.com/openai/whisper/blob/ba3f3cd54b0e5b8ce1ab3de13e32122d0d5f98ab/whisper/decoding.py#L697-L701
+                    {
+                        const float * logits_sot = state->logits.data() + i_sot*n_logits;
+
+                        const float logit_max = *std::max_element(logits_sot, logits_sot + n_logits);
+
+                        double sum = 0.0;
+                        for (int i = 0; i < n_logits; ++i) {
+                            sum += expf(logits_sot[i] - logit_max);
+                        }
+
+                        state->no_speech_prob = expf(logits_sot[whisper_token_nosp(ctx)] - logit_max)/sum;
+                    }
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
-                    state->no_speech_prob = probs[whisper_token_nosp(ctx)];
+                    // keep the prompt for the fallbacks, in the first free entry
+                    for (int e = 0; e < WHISPER_KV_N_PROMPT; ++e) {
+                        auto & entry = prompt_cache[e];
+
+                        if (!entry.tokens.empty()) {
+                            continue;
+                        }
+
+                        whisper_kv_cache_seq_cp(state->kv_self, 0, WHISPER_KV_SEQ_PROMPT + e, -1, -1);
+
+                        entry.tokens = prompt;
+                        entry.logits.assign(logits, logits + n_logits);
+                        entry.no_speech_prob = state->no_speech_prob;
+                        break;
+                    }
+
+                    state->decoders[0].i_batch = prompt.size() - 1;
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
-
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
                     for (int j = 1; j < n_decoders_cur; ++j) {
@@ -7157,12 +10113,17 @@ int whisper_full_with_state(
                         memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
                         memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
                         memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+
+                        decoder.stats = state->decoders[0].stats;
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
+            // the batcher (if any) waits for this state's steps until the generation loop is done
+            whisper_batcher_guard batcher_guard(state->batcher);
+
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
@@ -7173,11 +10134,11 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // the decoders are taken from a shared counter by the worker threads of the state
                 {
                     std::atomic<int> j_cur(0);
 
-                    auto process = [&]() {
+                    auto process = [&](int /*ith*/) {
                         while (true) {
                             const int j = j_cur.fetch_add(1);
 
@@ -7207,32 +10168,14 @@ int whisper_full_with_state(
                                         const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
                                         for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, token, decoder.sequence.sum_logprobs_all + token.plog, });
                                         }
                                     } break;
                             };
                         }
                     };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    whisper_worker_pool_run(state->workers, std::min(params.n_threads, n_decoders_cur), process);
                 }
 
                 beam_candidates.clear();
@@ -7250,16 +10193,24 @@ int whisper_full_with_state(
                             beam_candidates.begin(),
                             beam_candidates.end(),
                             [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+                            return a.sum_logprobs_all > b.sum_logprobs_all;
                         }
                         return a.decoder_idx < b.decoder_idx;
                     });
 
+                    // two candidates are the same sequence if they extend equal sequences with the same token
+                    auto candidates_equal = [&](const beam_candidate & a, const beam_candidate & b) {
+                        return a.token.id == b.token.id && (a.decoder_idx == b.decoder_idx ||
+                            whisper_sequence_tokens_equal(state->decoders[a.decoder_idx].sequence, state->decoders[b.decoder_idx].sequence));
+                    };
+
                     uint32_t cur_c = 0;
 
+                    std::fill(beam_n_uses.begin(), beam_n_uses.end(), 0);
+
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        const auto & decoder = state->decoders[j];
 
                         if (decoder.completed || decoder.failed) {
                             continue;
@@ -7269,18 +10220,58 @@ int whisper_full_with_state(
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        beam_selected[j] = cur_c;
+
+                        const auto & cur = beam_candidates[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_candidates.size() > cur_c && candidates_equal(beam_candidates[cur_c], cur) && i > 0) {
                             ++cur_c;
                         }
 
+                        beam_n_uses[cur.decoder_idx]++;
+                    }
+
+                    // take the sequences and the grammars of the selected decoders
+                    // they are moved out of a decoder when it is selected only once
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        const auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        const auto & cur = beam_candidates[beam_selected[j]];
+
+                        auto & src = state->decoders[cur.decoder_idx];
+
+                        if (--beam_n_uses[cur.decoder_idx] == 0) {
+                            beam_sequences[j] = std::move(src.sequence);
+                            beam_grammars [j] = std::move(src.grammar);
+                        } else {
+                            beam_sequences[j] = src.sequence;
+                            beam_grammars [j] = src.grammar;
+                        }
+
+                        beam_sequences[j].tokens.push_back(cur.token);
+                        beam_sequences[j].sum_logprobs_all = cur.sum_logprobs_all;
+
+                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                    }
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        const auto & cur = beam_candidates[beam_selected[j]];
+
                         decoder.seek_delta = cur.seek_delta;
                         decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
 
-                        whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
+                        std::swap(decoder.sequence, beam_sequences[j]);
+                        std::swap(decoder.grammar,  beam_grammars [j]);
 
                         WHISPER_LOG_DEBUG("%s: beam search: decoder %d: from decoder %d: token = %10s, plog = %8.5f, sum_logprobs = %8.5f\n",
                                 __func__, j, cur.decoder_idx, ctx->vocab.id_to_token.at(decoder.sequence.tokens.back().id).c_str(), decoder.sequence.tokens.back().plog, decoder.sequence.sum_logprobs_all);
@@ -7348,10 +10339,10 @@ int whisper_full_with_state(
                         // end of segment
                         if (token.id == whisper_token_eot(ctx) ||               // end of text token
                            (params.max_tokens > 0 && i >= params.max_tokens) || // max tokens per segment reached
-                           (has_ts && seek + seek_delta + delta_min >= seek_end)       // end of audio reached (100ms)
+                           (has_ts && seek + seek_delta + delta_min >= seek_end_win)   // end of audio reached (100ms)
                            ) {
                             if (result_len == 0 && !params.no_timestamps) {
-                                if (seek + seek_delta + delta_min >= seek_end) {
+                                if (seek + seek_delta + delta_min >= seek_end_win) {
                                     result_len = i + 1;
                                 } else {
                                     WHISPER_LOG_DEBUG("%s: decoder %d failed (result_len = 0)\n", __func__, j);
@@ -7408,6 +10399,100 @@ int whisper_full_with_state(
 
                 state->t_sample_us += ggml_time_us() - t_start_sample_us;
 
+                // obtain logits for the next token with the draft model and a verification by the main model
+                if (speculative) {
+                    auto & decoder = state->decoders[0];
+
+                    const whisper_token id = decoder.sequence.tokens.back().id;
+
+                    const int n_past = prompt.size() + i;
+
+                    if (spec.i_row + 1 < (int) spec.rows.size() && spec.rows[spec.i_row + 1] == id) {
+                        // the drafted token is accepted - its logits have been computed already
+                        spec.i_row++;
+                        state->n_accepted++;
+                    } else {
+                        // drop the rejected tokens and draft new ones
+                        whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+
+                        const int64_t t_start_draft_us = ggml_time_us();
+
+                        whisper_state & dstate = *state->draft;
+
+                        bool ok_draft = true;
+
+                        if (!spec.encoded) {
+                            whisper_audio_ctx_set(*ctx_draft, dstate, state->exp_n_audio_ctx <= whisper_n_audio_ctx(ctx_draft) ? state->exp_n_audio_ctx : 0);
+
+                            ok_draft = whisper_encode_internal(*ctx_draft, dstate, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data);
+                            if (ok_draft) {
+                                whisper_kv_cache_clear(dstate.kv_self);
+                                spec.past.clear();
+                                spec.encoded = true;
+                            }
+                        }
+
+                        spec.draft.clear();
+
+                        if (ok_draft) {
+                            spec.tokens = prompt;
+                            for (const auto & token : decoder.sequence.tokens) {
+                                spec.tokens.push_back(token.id);
+                            }
+
+                            // the drafted tokens must fit in the text context of both models
+                            const int n_draft_cur = std::min(std::min(n_draft, n_max - 1 - i),
+                                    std::min(whisper_n_text_ctx(ctx), whisper_n_text_ctx(ctx_draft)) - 1 - n_past);
+
+                            ok_draft = n_draft_cur <= 0 || whisper_speculative_draft(*ctx_draft, dstate, params_draft, decoder, spec.tokens, spec.past, n_draft_cur, spec.draft);
+                        }
+
+                        if (ok_draft) {
+                            state->t_draft_us += ggml_time_us() - t_start_draft_us;
+                            state->n_drafted  += spec.draft.size();
+                        } else {
+                            // the main model does not depend on the draft model - this token is verified without a draft
+                            // and the rest of the call uses the normal decoding
+                            WHISPER_LOG_WARN("%s: failed to run the draft model - speculative decoding disabled\n", __func__);
+
+                            spec.draft.clear();
+
+                            ctx_draft   = nullptr;
+                            speculative = false;
+                        }
+
+                        spec.rows.assign(1, id);
+                        spec.rows.insert(spec.rows.end(), spec.draft.begin(), spec.draft.end());
+                        spec.i_row = 0;
+
+                        auto & batch = state->batch;
+
+                        batch.n_tokens = spec.rows.size();
+                        for (int r = 0; r < batch.n_tokens; ++r) {
+                            batch.token   [r]    = spec.rows[r];
+                            batch.pos     [r]    = n_past + r;
+                            batch.n_seq_id[r]    = 1;
+                            batch.seq_id  [r][0] = 0;
+                            batch.logits  [r]    = 1;
+                        }
+
+                        if (!whisper_decode_internal(*ctx, *state, batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
+                            return -9;
+                        }
+                    }
+
+                    const int64_t t_start_sample_us = ggml_time_us();
+
+                    decoder.i_batch = spec.i_row;
+
+                    whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+
+                    state->t_sample_us += ggml_time_us() - t_start_sample_us;
+
+                    continue;
+                }
+
                 // obtain logits for the next token
                 {
                     auto & batch = state->batch;
@@ -7437,18 +10522,17 @@ int whisper_full_with_state(
 
                     assert(batch.n_tokens > 0);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                    if (!whisper_decode_step(*ctx, *state, state->batch, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
                         WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                         return -9;
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
                     {
                         std::atomic<int> j_cur(0);
 
-                        auto process = [&]() {
+                        auto process = [&](int /*ith*/) {
                             while (true) {
                                 const int j = j_cur.fetch_add(1);
 
@@ -7466,23 +10550,7 @@ int whisper_full_with_state(
                             }
                         };
 
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                        whisper_worker_pool_run(state->workers, std::min(params.n_threads, n_decoders_cur), process);
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
@@ -7689,7 +10757,7 @@ int whisper_full_with_state(
             {
                 const int n_segments = state->result_all.size() - n_segments_before;
                 if (ctx->params.dtw_token_timestamps && n_segments) {
-                    const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
+                    const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end_win - seek);
                     whisper_exp_compute_token_level_timestamps_dtw(
                             ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
                     if (params.new_segment_callback) {
@@ -7706,7 +10774,7 @@ int whisper_full_with_state(
                 tokens_cur[tokens_cur.size() - 1].id > whisper_token_beg(ctx);
             if (single_timestamp_ending) {
                 WHISPER_LOG_DEBUG("single timestamp ending - skip entire chunk\n");
-                seek_delta = std::min(seek_end - seek, WHISPER_CHUNK_SIZE * 100);
+                seek_delta = std::min(seek_end_win - seek, WHISPER_CHUNK_SIZE * 100);
             }
 
             // update audio window
@@ -7719,27 +10787,201 @@ int whisper_full_with_state(
     return 0;
 }
 
-int whisper_full(
+int whisper_full_with_state(
         struct whisper_context * ctx,
+          struct whisper_state * state,
     struct whisper_full_params   params,
                    const float * samples,
                            int   n_samples) {
 
     std::vector<float> vad_samples;
-    if (params.vad) {
+    if (params.vad && params.vad_seek) {
+        WHISPER_LOG_INFO("%s: VAD is enabled, skipping the silence between the speech segments\n", __func__);
+        if (!whisper_vad_seek_segments(state, params, samples, n_samples)) {
+            WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
+            return -1;
+        }
+        if (state->vad_seek_segments.empty()) {
+            state->result_all.clear();
+            return 0;
+        }
+    } else if (params.vad) {
         WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
+        if (!whisper_vad(state, params, samples, n_samples, vad_samples)) {
             WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
             return -1;
         }
         if (vad_samples.empty()) {
-            ctx->state->result_all.clear();
+            state->result_all.clear();
             return 0;
         }
         samples = vad_samples.data();
         n_samples = vad_samples.size();
+    } else {
+        state->has_vad_segments = false;
+        state->vad_mapping_table.clear();
+    }
+    return whisper_full_internal(ctx, state, params, samples, n_samples);
+}
+
+int whisper_full(
+        struct whisper_context * ctx,
+    struct whisper_full_params   params,
+                   const float * samples,
+                           int   n_samples) {
+    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+}
+
+// pick the split points for whisper_full_parallel()
+// prefer gaps between VAD segments and fall back to the quietest stretch of audio near each ideal boundary
+static std::vector<int> whisper_parallel_split_points(
+        struct whisper_state * state,
+                 const float * samples,
+                           int   n_samples,
+                           int   offset_samples,
+                           int   n_chunks,
+                           int   n_search) {
+    std::vector<int> res;
+
+    const int n_per_chunk = (n_samples - offset_samples)/n_chunks;
+
+    // length of the window over which the energy is averaged when looking for a quiet point
+    const int n_win = WHISPER_SAMPLE_RATE/10;
+
+    for (int i = 1; i < n_chunks; ++i) {
+        const int ideal = offset_samples + i*n_per_chunk;
+
+        const int s0 = std::max(ideal - n_search, res.empty() ? offset_samples : res.back() + n_per_chunk/2);
+        const int s1 = std::min(ideal + n_search, n_samples - n_per_chunk/2);
+
+        int best = ideal;
+
+        if (s1 - s0 > n_win) {
+            bool found = false;
+
+            if (state->has_vad_segments) {
+                // the samples are the concatenated speech segments - split at the closest join
+                int64_t best_dist = INT64_MAX;
+                for (const auto & seg : state->vad_segments) {
+                    const int join = (int) ((seg.vad_end*WHISPER_SAMPLE_RATE)/100);
+                    if (join > s0 && join < s1 && std::abs(join - ideal) < best_dist) {
+                        best_dist = std::abs(join - ideal);
+                        best = join;
+                        found = true;
+                    }
+                }
+            }
+
+            if (!found) {
+                const std::vector<float> energy = get_signal_energy(samples + s0, s1 - s0, 32);
+
+                double sum = 0.0;
+                for (int j = 0; j < n_win; ++j) {
+                    sum += energy[j];
+                }
+
+                double sum_min = sum;
+                int    j_min   = 0;
+
+                for (int j = n_win; j < (int) energy.size(); ++j) {
+                    sum += energy[j] - energy[j - n_win];
+                    if (sum < sum_min) {
+                        sum_min = sum;
+                        j_min   = j - n_win + 1;
+                    }
+                }
+
+                best = s0 + j_min + n_win/2;
+            }
+        }
+
+        res.push_back(best);
+    }
+
+    return res;
+}
+
+// rebuild the segment text from its tokens
+static void whisper_segment_update_text(struct whisper_context * ctx, whisper_segment & segment) {
+    segment.text.clear();
+    for (const auto & token : segment.tokens) {
+        if (token.id < whisper_token_eot(ctx)) {
+            segment.text += whisper_token_to_str(ctx, token.id);
+        }
+    }
+}
+
+// remove the text that was transcribed twice in the overlap between two chunks
+// returns false if the whole new segment is a duplicate of the end of the previous one
+static bool whisper_parallel_dedup(struct whisper_context * ctx, whisper_segment & prev, whisper_segment & cur) {
+    const whisper_token token_eot = whisper_token_eot(ctx);
+
+    std::vector<int> ip;
+    std::vector<int> ic;
+
+    for (int i = 0; i < (int) prev.tokens.size(); ++i) {
+        if (prev.tokens[i].id < token_eot) {
+            ip.push_back(i);
+        }
+    }
+    for (int i = 0; i < (int) cur.tokens.size(); ++i) {
+        if (cur.tokens[i].id < token_eot) {
+            ic.push_back(i);
+        }
+    }
+
+    if (ip.empty() || ic.empty()) {
+        return !ic.empty();
+    }
+
+    // find the longest run of text tokens at the end of prev that is repeated at the start of cur
+    // tolerate a couple of tokens of a word that was cut at the chunk edge on either side
+    const int n_skip_max = 2;
+
+    int best_k = 0;
+    int best_e = 0;
+    int best_s = 0;
+
+    for (int e = 0; e <= n_skip_max && e < (int) ip.size(); ++e) {
+        for (int s = 0; s <= n_skip_max && s < (int) ic.size(); ++s) {
+            const int k_max = std::min((int) ip.size() - e, (int) ic.size() - s);
+            for (int k = k_max; k > best_k; --k) {
+                bool match = true;
+                for (int j = 0; j < k && match; ++j) {
+                    match = prev.tokens[ip[ip.size() - e - k + j]].id == cur.tokens[ic[s + j]].id;
+                }
+                if (match) {
+                    best_k = k;
+                    best_e = e;
+                    best_s = s;
+                    break;
+                }
+            }
+        }
+    }
+
+    // a single common token is not enough evidence, unless it is all there is
+    if (best_k < 2 && !(best_k == 1 && best_s == 0 && ic.size() == 1)) {
+        return true;
+    }
+
+    if (best_e > 0) {
+        prev.tokens.erase(prev.tokens.begin() + ip[ip.size() - best_e], prev.tokens.end());
+        whisper_segment_update_text(ctx, prev);
     }
-    return whisper_full_with_state(ctx, ctx->state, params, samples, n_samples);
+
+    if (best_s + best_k == (int) ic.size()) {
+        return false;
+    }
+
+    cur.tokens.erase(cur.tokens.begin(), cur.tokens.begin() + ic[best_s + best_k]);
+    whisper_segment_update_text(ctx, cur);
+
+    if (cur.tokens[0].t0 >= 0) {
+        cur.t0 = std::max(cur.t0, cur.tokens[0].t0);
+    }
+
+    return true;
 }
 
 int whisper_full_parallel(
@@ -7753,37 +10995,133 @@ int whisper_full_parallel(
         return whisper_full(ctx, params, samples, n_samples);
     }
 
+    // the chunks are split at the joins of the filtered audio
+    params.vad_seek = false;
+
     std::vector<float> vad_samples;
     if (params.vad) {
         WHISPER_LOG_INFO("%s: VAD is enabled, processing speech segments only\n", __func__);
-        if (!whisper_vad(ctx, ctx->state, params, samples, n_samples, vad_samples)) {
+        if (!whisper_vad(ctx->state, params, samples, n_samples, vad_samples)) {
             WHISPER_LOG_ERROR("%s: failed to compute VAD\n", __func__);
             return -1;
         }
         if (vad_samples.empty()) {
+            ctx->state->result_all.clear();
             return 0;
         }
         samples = vad_samples.data();
         n_samples = vad_samples.size();
+    } else {
+        ctx->state->has_vad_segments = false;
+        ctx->state->vad_mapping_table.clear();
     }
-    int ret = 0;
-
-    // prepare separate states for each thread
-    std::vector<whisper_state*> states;
 
     const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
-    const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
+
+    // the split points are moved by up to this much to land in a pause
+    const int n_search  = 5*WHISPER_SAMPLE_RATE;
+
+    // neighbouring chunks share this much audio on each side of a split
+    const int n_overlap = 1*WHISPER_SAMPLE_RATE;
+
+    // do not split into chunks that are too short to carry any context
+    n_processors = std::min(n_processors, std::max(1, (n_samples - offset_samples)/(2*n_search)));
+    if (n_processors == 1) {
+        return whisper_full_internal(ctx, ctx->state, params, samples, n_samples);
+    }
+
+    const std::vector<int> splits = whisper_parallel_split_points(ctx->state, samples, n_samples, offset_samples, n_processors, n_search);
+
+    // chunk i covers [bounds[i], bounds[i + 1]) plus the overlap
+    std::vector<int> bounds;
+    bounds.push_back(offset_samples);
+    bounds.insert(bounds.end(), splits.begin(), splits.end());
+    bounds.push_back(n_samples);
+
+    // reuse the states from previous calls
+    auto & states = ctx->states_pool;
+    while ((int) states.size() < n_processors - 1) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to initialize state\n", __func__);
+            return -2;
+        }
+        states.push_back(state);
+    }
+
+    // encode the first window of all chunks in a single batched graph, using the threads of all processors
+    // the chunks then start with an encoded window, unless their audio_ctx differs (see whisper_encode_batch())
+    {
+        std::vector<whisper_state *> states_enc;
+        std::vector<int>             offsets_enc;
+
+        for (int i = 0; i < n_processors; ++i) {
+            states_enc.push_back(i == 0 ? ctx->state : states[i - 1]);
+            offsets_enc.push_back(i == 0 ? params.offset_ms/10 : 0);
+
+            if (i > 0) {
+                whisper_state_reset_timings(states_enc[i]);
+            }
+        }
+
+        // the spectrograms of the chunks are computed in parallel, the calling thread takes the first chunk
+        std::vector<int> rets_mel(n_processors, 0);
+
+        auto compute_mel = [&](int i) {
+            const int start_samples = i == 0 ? 0 : std::max(offset_samples, bounds[i] - n_overlap);
+            const int end_samples   = std::min(n_samples, bounds[i + 1] + n_overlap);
+
+            rets_mel[i] = whisper_pcm_to_mel_with_state(ctx, states_enc[i], samples + start_samples, end_samples - start_samples, params.n_threads);
+        };
+
+        std::vector<std::thread> workers_mel;
+        for (int i = 1; i < n_processors; ++i) {
+            workers_mel.emplace_back(compute_mel, i);
+        }
+
+        compute_mel(0);
+
+        for (auto & worker : workers_mel) {
+            worker.join();
+        }
+
+        for (int i = 0; i < n_processors; ++i) {
+            if (rets_mel[i] != 0) {
+                WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
+                return -2;
+            }
+
+            whisper_state * state = states_enc[i];
+
+            // the same audio_ctx as the one that whisper_full_internal() sets for the first window
+            if (params.audio_ctx >= 0) {
+                whisper_audio_ctx_set(*ctx, *state, std::min(params.audio_ctx, whisper_n_audio_ctx(ctx)));
+            } else {
+                whisper_audio_ctx_set(*ctx, *state, whisper_audio_ctx_adaptive(*ctx, whisper_n_len_from_state(state)));
+            }
+        }
+
+        if (whisper_encode_batch(ctx, states_enc.data(), offsets_enc.data(), n_processors, params.n_threads*n_processors) != 0) {
+            WHISPER_LOG_WARN("%s: failed to encode the first windows - the chunks will encode them\n", __func__);
+            for (whisper_state * state : states_enc) {
+                state->enc_mel_offset = -1;
+            }
+        }
+    }
+
+    std::vector<int> rets(n_processors - 1, 0);
 
     // the calling thread will process the first chunk
     // while the other threads will process the remaining chunks
 
     std::vector<std::thread> workers(n_processors - 1);
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
+        whisper_state * state = states[i];
 
-        const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
-        const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
+        state->prompt_past.clear();
+
+        const int start_samples = std::max(offset_samples, bounds[i + 1] - n_overlap);
+        const int end_samples   = std::min(n_samples,      bounds[i + 2] + n_overlap);
 
         auto params_cur = params;
 
@@ -7797,40 +11135,93 @@ int whisper_full_parallel(
         params_cur.progress_callback = nullptr;
         params_cur.progress_callback_user_data = nullptr;
 
-        workers[i] = std::thread(whisper_full_with_state, ctx, states[i], std::move(params_cur), samples + start_samples, n_samples_cur);
+        workers[i] = std::thread([ctx, state, params_cur, samples, start_samples, end_samples, &rets, i]() {
+            rets[i] = whisper_full_internal(ctx, state, params_cur, samples + start_samples, end_samples - start_samples, true);
+        });
     }
 
+    int ret = 0;
+
     {
         auto params_cur = params;
 
         // We need to disable the print real-time for this one as well, otherwise it will show only for the first chunk.
         params_cur.print_realtime = false;
 
+        // the segments are reported after merging, once it is known which ones are kept
+        params_cur.new_segment_callback = nullptr;
+        params_cur.new_segment_callback_user_data = nullptr;
+
         // Run the first transformation using default state but only for the first chunk.
-        ret = whisper_full_with_state(ctx, ctx->state, std::move(params_cur), samples, offset_samples + n_samples_per_processor);
+        ret = whisper_full_internal(ctx, ctx->state, std::move(params_cur), samples, std::min(n_samples, bounds[1] + n_overlap), true);
     }
 
     for (int i = 0; i < n_processors - 1; ++i) {
         workers[i].join();
+        if (ret == 0 && rets[i] != 0) {
+            ret = rets[i];
+        }
+    }
+
+    // convert a sample position to centiseconds
+    auto to_cs = [](int64_t n) { return (100*n)/WHISPER_SAMPLE_RATE; };
+
+    auto & result_all = ctx->state->result_all;
+
+    // keep the segments of each chunk that are centered inside its own range
+    {
+        const int64_t t_split = to_cs(bounds[1]);
+
+        result_all.erase(std::remove_if(result_all.begin(), result_all.end(), [&](const whisper_segment & s) {
+            return s.t0 + s.t1 >= 2*t_split;
+        }), result_all.end());
     }
 
-    const int64_t offset_t = (int64_t) params.offset_ms/10.0;
+    if (params.new_segment_callback && !result_all.empty()) {
+        params.new_segment_callback(ctx, ctx->state, result_all.size(), params.new_segment_callback_user_data);
+    }
 
-    // combine results into result_state->result_all from all other states
     for (int i = 0; i < n_processors - 1; ++i) {
-        auto& results_i = states[i]->result_all;
+        auto & results_i = states[i]->result_all;
+
+        const int start_samples = std::max(offset_samples, bounds[i + 1] - n_overlap);
 
-        for (auto& result : results_i) {
+        const int64_t t_shift = to_cs(start_samples);
+        const int64_t t_beg   = to_cs(bounds[i + 1]);
+        const int64_t t_end   = to_cs(bounds[i + 2]);
+
+        bool first = true;
+
+        for (auto & result : results_i) {
             // correct the segment timestamp taking into account the offset
-            result.t0 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
-            result.t1 += 100 * ((i + 1) * n_samples_per_processor) / WHISPER_SAMPLE_RATE + offset_t;
+            result.t0 += t_shift;
+            result.t1 += t_shift;
+
+            for (auto & token : result.tokens) {
+                if (token.t0    >= 0) token.t0    += t_shift;
+                if (token.t1    >= 0) token.t1    += t_shift;
+                if (token.t_dtw >= 0) token.t_dtw += t_shift;
+            }
+
+            const int64_t t_mid2 = result.t0 + result.t1;
+            if (t_mid2 < 2*t_beg || (i < n_processors - 2 && t_mid2 >= 2*t_end)) {
+                continue;
+            }
+
+            if (first && !result_all.empty() && result.t0 < result_all.back().t1 + 100) {
+                if (!whisper_parallel_dedup(ctx, result_all.back(), result)) {
+                    continue;
+                }
+            }
+            first = false;
 
             // make sure that segments are not overlapping
-            if (!ctx->state->result_all.empty()) {
-                result.t0 = std::max(result.t0, ctx->state->result_all.back().t1);
+            if (!result_all.empty()) {
+                result.t0 = std::max(result.t0, result_all.back().t1);
+                result.t1 = std::max(result.t1, result.t0);
             }
 
-            ctx->state->result_all.push_back(std::move(result));
+            result_all.push_back(std::move(result));
 
             // call the new_segment_callback for each segment
             if (params.new_segment_callback) {
@@ -7838,6 +11229,8 @@ int whisper_full_parallel(
             }
         }
 
+        results_i.clear();
+
         ctx->state->t_mel_us += states[i]->t_mel_us;
 
         ctx->state->t_sample_us += states[i]->t_sample_us;
@@ -7851,8 +11244,6 @@ int whisper_full_parallel(
         ctx->state->n_decode += states[i]->n_decode;
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
-
-        whisper_free_state(states[i]);
     }
 
     // average the timings
@@ -7862,12 +11253,10 @@ int whisper_full_parallel(
     ctx->state->t_decode_us /= n_processors;
 
     // print information about the audio boundaries
-    WHISPER_LOG_WARN("\n");
-    WHISPER_LOG_WARN("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
+    WHISPER_LOG_INFO("%s: the audio has been split into %d chunks at the following times:\n", __func__, n_processors);
     for (int i = 0; i < n_processors - 1; ++i) {
-        WHISPER_LOG_WARN("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(100*((i + 1)*n_samples_per_processor)/WHISPER_SAMPLE_RATE + offset_t).c_str());
+        WHISPER_LOG_INFO("%s: split %d - %s\n", __func__, (i + 1), to_timestamp(to_cs(splits[i])).c_str());
     }
-    WHISPER_LOG_WARN("%s: the transcription quality may be degraded near these boundaries\n", __func__);
 
     return ret;
 }
@@ -8318,6 +11707,373 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+WHISPER_API int whisper_bench_fft(int n_threads) {
+    fputs(whisper_bench_fft_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_fft_str(int /*n_threads*/) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    const int N        = WHISPER_N_FFT;
+    const int n_bins   = N/2 + 1;
+    const int n_frames = 256;
+
+    const whisper_rfft_plan & plan = global_cache.rfft_plan;
+
+    // Hann-windowed noise, similar to the input of the log-mel spectrogram
+    std::vector<float> frames(n_frames*N);
+    {
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+        for (int i = 0; i < n_frames; ++i) {
+            for (int j = 0; j < N; ++j) {
+                frames[i*N + j] = global_cache.hann_window[j]*dist(rng);
+            }
+        }
+    }
+
+    // the legacy fft() uses the input and the output buffers as scratch space
+    std::vector<float> ref_in (2*N);
+    std::vector<float> ref_out(8*N);
+    std::vector<float> out_ref(n_frames*2*n_bins);
+
+    std::vector<float> work(2*N);
+    std::vector<float> out_new(n_frames*2*n_bins);
+
+    double t_ref = 0.0;
+    double t_new = 0.0;
+
+    int n_ref = 0;
+    int n_new = 0;
+
+    // legacy recursive FFT
+    {
+        double tsum = 0.0;
+        for (int k = 0; ; ++k) {
+            const int64_t t0 = ggml_time_us();
+
+            for (int i = 0; i < n_frames; ++i) {
+                std::copy(frames.begin() + i*N, frames.begin() + (i + 1)*N, ref_in.begin());
+                fft(ref_in.data(), N, ref_out.data());
+                std::copy(ref_out.begin(), ref_out.begin() + 2*n_bins, out_ref.begin() + i*2*n_bins);
+            }
+
+            const int64_t t1 = ggml_time_us();
+
+            tsum += (t1 - t0)*1e-6;
+            n_ref++;
+
+            if (tsum > 0.5 && k >= 3) {
+                break;
+            }
+        }
+        t_ref = tsum/(n_ref*n_frames);
+    }
+
+    // planned real FFT
+    {
+        double tsum = 0.0;
+        for (int k = 0; ; ++k) {
+            const int64_t t0 = ggml_time_us();
+
+            for (int i = 0; i < n_frames; ++i) {
+                rfft(plan, frames.data() + i*N, out_new.data() + i*2*n_bins, work.data());
+            }
+
+            const int64_t t1 = ggml_time_us();
+
+            tsum += (t1 - t0)*1e-6;
+            n_new++;
+
+            if (tsum > 0.5 && k >= 3) {
+                break;
+            }
+        }
+        t_new = tsum/(n_new*n_frames);
+    }
+
+    // double-precision DFT as ground truth
+    std::vector<double> out_dbl(n_frames*2*n_bins);
+    {
+        std::vector<double> cos_dbl(N);
+        std::vector<double> sin_dbl(N);
+        for (int i = 0; i < N; ++i) {
+            cos_dbl[i] = cos(2.0*M_PI*i/N);
+            sin_dbl[i] = sin(2.0*M_PI*i/N);
+        }
+
+        for (int i = 0; i < n_frames; ++i) {
+            for (int k = 0; k < n_bins; ++k) {
+                double re = 0.0;
+                double im = 0.0;
+                for (int j = 0; j < N; ++j) {
+                    const int idx = (k*j) % N;
+                    re += frames[i*N + j]*cos_dbl[idx];
+                    im -= frames[i*N + j]*sin_dbl[idx];
+                }
+                out_dbl[i*2*n_bins + 2*k + 0] = re;
+                out_dbl[i*2*n_bins + 2*k + 1] = im;
+            }
+        }
+    }
+
+    // errors of the power spectrum, relative to the peak power of each frame
+    double err_new_ref = 0.0;
+    double err_new_dbl = 0.0;
+    double err_ref_dbl = 0.0;
+    int    n_bitexact  = 0;
+
+    for (int i = 0; i < n_frames; ++i) {
+        double p_max = 0.0;
+        for (int k = 0; k < n_bins; ++k) {
+            const double * d = out_dbl.data() + i*2*n_bins + 2*k;
+            p_max = std::max(p_max, d[0]*d[0] + d[1]*d[1]);
+        }
+
+        for (int k = 0; k < n_bins; ++k) {
+            const float  * r = out_ref.data() + i*2*n_bins + 2*k;
+            const float  * c = out_new.data() + i*2*n_bins + 2*k;
+            const double * d = out_dbl.data() + i*2*n_bins + 2*k;
+
+            const float  p_ref = r[0]*r[0] + r[1]*r[1];
+            const float  p_new = c[0]*c[0] + c[1]*c[1];
+            const double p_dbl = d[0]*d[0] + d[1]*d[1];
+
+            err_new_ref = std::max(err_new_ref, std::fabs(p_new - p_ref)/p_max);
+            err_new_dbl = std::max(err_new_dbl, std::fabs(p_new - p_dbl)/p_max);
+            err_ref_dbl = std::max(err_ref_dbl, std::fabs(p_ref - p_dbl)/p_max);
+
+            n_bitexact += p_new == p_ref;
+        }
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "fft %d: legacy %8.3f us/frame (%4d runs) | planned rfft %8.3f us/frame (%4d runs) | speedup %5.2fx\n",
+            N, 1e6*t_ref, n_ref, 1e6*t_new, n_new, t_ref/t_new);
+    s += strbuf;
+
+    snprintf(strbuf, sizeof(strbuf), "fft %d: max rel power error: rfft vs legacy %.3e | rfft vs f64 %.3e | legacy vs f64 %.3e | bit-exact bins %d / %d\n",
+            N, err_new_ref, err_new_dbl, err_ref_dbl, n_bitexact, n_frames*n_bins);
+    s += strbuf;
+
+    return s.c_str();
+}
+
+// multi-pass logits processing, as done before whisper_logits_softmax()
+// reference implementation, used only by whisper_bench_sampling
+static int logits_softmax_ref(
+        const float * src, float * logits, float * logprobs, float * probs,
+        int n_logits, int token_beg, float temperature, const std::vector<int> & suppress) {
+    for (int i = 0; i < n_logits; ++i) {
+        logits[i] = src[i]/temperature;
+    }
+    for (int id : suppress) {
+        logits[id] = -INFINITY;
+    }
+
+    // log_softmax
+    {
+        const float logit_max = *std::max_element(logits, logits + n_logits);
+        float logsumexp = 0.0f;
+        for (int i = 0; i < n_logits; ++i) {
+            if (logits[i] > -INFINITY) {
+                logsumexp += expf(logits[i] - logit_max);
+            }
+        }
+        logsumexp = logf(logsumexp) + logit_max;
+
+        for (int i = 0; i < n_logits; ++i) {
+            logprobs[i] = logits[i] > -INFINITY ? logits[i] - logsumexp : -INFINITY;
+        }
+    }
+
+    // timestamp rule
+    {
+        float timestamp_logprob = -INFINITY;
+        {
+            float logsumexp = 0.0f;
+            const float logprob_max = *std::max_element(logprobs + token_beg, logprobs + n_logits);
+            for (int i = token_beg; i < n_logits; ++i) {
+                if (logprobs[i] > -INFINITY) {
+                    logsumexp += expf(logprobs[i] - logprob_max);
+                }
+            }
+            if (logsumexp > 0.0f) {
+                timestamp_logprob = logf(logsumexp) + logprob_max;
+            }
+        }
+
+        const float max_text_token_logprob = *std::max_element(logprobs, logprobs + token_beg);
+
+        if (timestamp_logprob > max_text_token_logprob) {
+            for (int i = 0; i < token_beg; ++i) {
+                logits[i]   = -INFINITY;
+                logprobs[i] = -INFINITY;
+            }
+        }
+    }
+
+    for (int i = 0; i < n_logits; ++i) {
+        probs[i] = logits[i] == -INFINITY ? 0.0f : expf(logprobs[i]);
+    }
+
+    // best token
+    int   id = 0;
+    float p  = 0.0f;
+    for (int i = 0; i < n_logits; ++i) {
+        if (p < probs[i]) {
+            id = i;
+            p  = probs[i];
+        }
+    }
+
+    return id;
+}
+
+WHISPER_API int whisper_bench_sampling(int n_threads) {
+    fputs(whisper_bench_sampling_str(n_threads), stderr);
+    return 0;
+}
+
+WHISPER_API const char * whisper_bench_sampling_str(int /*n_threads*/) {
+    static std::string s;
+    s = "";
+    char strbuf[256];
+
+    ggml_time_init();
+
+    // vocab layout of the multilingual models
+    const int n_vocab   = 51865;
+    const int token_sot = 50258;
+    const int token_beg = 50364;
+    const int n_rows    = 64;
+
+    const float temperature = 0.2f;
+
+    // special, task and language tokens
+    std::vector<int> suppress;
+    for (int i = token_sot; i < token_beg; ++i) {
+        suppress.push_back(i);
+    }
+
+    std::vector<uint64_t> mask((n_vocab + 63)/64, 0);
+    for (int id : suppress) {
+        whisper_suppress_mask_set(mask, id);
+    }
+
+    // decoder-like logits: a few likely tokens on top of a broad background
+    std::vector<float> src(n_rows*n_vocab);
+    {
+        std::mt19937 rng(1234);
+        std::normal_distribution<float> dist(0.0f, 2.0f);
+        std::uniform_int_distribution<int> tok(0, n_vocab - 1);
+
+        for (int r = 0; r < n_rows; ++r) {
+            for (int i = 0; i < n_vocab; ++i) {
+                src[r*n_vocab + i] = dist(rng);
+            }
+            for (int k = 0; k < 4; ++k) {
+                src[r*n_vocab + tok(rng)] += 6.0f + 2.0f*k;
+            }
+        }
+    }
+
+    std::vector<float> logits  (n_vocab);
+    std::vector<float> logprobs_ref(n_rows*n_vocab);
+    std::vector<float> probs_ref   (n_rows*n_vocab);
+    std::vector<float> logprobs_new(n_rows*n_vocab);
+    std::vector<float> probs_new   (n_rows*n_vocab);
+
+    std::vector<int> id_ref(n_rows);
+    std::vector<int> id_new(n_rows);
+
+    double t_ref = 0.0;
+    double t_new = 0.0;
+
+    int n_ref = 0;
+    int n_new = 0;
+
+    // legacy multi-pass
+    {
+        double tsum = 0.0;
+        for (int k = 0; ; ++k) {
+            const int64_t t0 = ggml_time_us();
+
+            for (int r = 0; r < n_rows; ++r) {
+                id_ref[r] = logits_softmax_ref(src.data() + r*n_vocab, logits.data(),
+                        logprobs_ref.data() + r*n_vocab, probs_ref.data() + r*n_vocab, n_vocab, token_beg, temperature, suppress);
+            }
+
+            const int64_t t1 = ggml_time_us();
+
+            tsum += (t1 - t0)*1e-6;
+            n_ref++;
+
+            if (tsum > 0.5 && k >= 3) {
+                break;
+            }
+        }
+        t_ref = tsum/(n_ref*n_rows);
+    }
+
+    // fused
+    {
+        whisper_logits_stats stats;
+
+        double tsum = 0.0;
+        for (int k = 0; ; ++k) {
+            const int64_t t0 = ggml_time_us();
+
+            for (int r = 0; r < n_rows; ++r) {
+                whisper_logits_prepare(src.data() + r*n_vocab, logits.data(), n_vocab, temperature, mask);
+                whisper_logits_softmax(logits.data(), logprobs_new.data() + r*n_vocab, probs_new.data() + r*n_vocab, n_vocab, token_beg, true, stats);
+                id_new[r] = stats.id_max;
+            }
+
+            const int64_t t1 = ggml_time_us();
+
+            tsum += (t1 - t0)*1e-6;
+            n_new++;
+
+            if (tsum > 0.5 && k >= 3) {
+                break;
+            }
+        }
+        t_new = tsum/(n_new*n_rows);
+    }
+
+    double err_logprob = 0.0;
+    double err_prob    = 0.0;
+    int    n_argmax    = 0;
+
+    for (int r = 0; r < n_rows; ++r) {
+        for (int i = 0; i < n_vocab; ++i) {
+            const float lr = logprobs_ref[r*n_vocab + i];
+            const float ln = logprobs_new[r*n_vocab + i];
+            if (lr > -INFINITY || ln > -INFINITY) {
+                err_logprob = std::max(err_logprob, (double) std::fabs(ln - lr));
+            }
+            err_prob = std::max(err_prob, (double) std::fabs(probs_new[r*n_vocab + i] - probs_ref[r*n_vocab + i]));
+        }
+        n_argmax += id_new[r] == id_ref[r];
+    }
+
+    snprintf(strbuf, sizeof(strbuf), "sampling %d: legacy %8.3f us/token (%4d runs) | fused %8.3f us/token (%4d runs) | speedup %5.2fx\n",
+            n_vocab, 1e6*t_ref, n_ref, 1e6*t_new, n_new, t_ref/t_new);
+    s += strbuf;
+
+    snprintf(strbuf, sizeof(strbuf), "sampling %d: max abs error: logprobs %.3e | probs %.3e | same argmax %d / %d\n",
+            n_vocab, err_logprob, err_prob, n_argmax, n_rows);
+    s += strbuf;
+
+    return s.c_str();
+}
+
 // =================================================================================================
 
 // =================================================================================================
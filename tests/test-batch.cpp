@@ -0,0 +1,308 @@
+#include "whisper.h"
+#include "common-whisper.h"
+#include "ggml.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+#include <cassert>
+
+// the test models carry no weights - build a small model with random weights from the hparams, filters and vocab
+// of one of them, so that different inputs give different results
+std::vector<char> make_random_model(const std::string & path_base, int32_t n_text_layer = 2) {
+    std::ifstream fin(path_base, std::ios::binary);
+    assert(fin.good());
+
+    std::vector<char> res((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+    assert(res.size() > 48);
+
+    const int32_t n_state = 64;
+    const int32_t n_head  = 2;
+    const int32_t n_layer = 2;
+
+    // n_vocab, n_audio_ctx, n_audio_state, n_audio_head, n_audio_layer,
+    // n_text_ctx, n_text_state, n_text_head, n_text_layer, n_mels, ftype
+    int32_t hparams[11];
+    memcpy(hparams, res.data() + 4, sizeof(hparams));
+
+    const int32_t n_vocab  = hparams[0];
+    const int32_t n_ctx_a  = hparams[1];
+    const int32_t n_ctx_t  = hparams[5];
+    const int32_t n_mels   = hparams[9];
+
+    const int32_t hparams_new[11] = { n_vocab, n_ctx_a, n_state, n_head, n_layer, n_ctx_t, n_state, n_head, n_text_layer, n_mels, 1 };
+    memcpy(res.data() + 4, hparams_new, sizeof(hparams_new));
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 0.4f);
+
+    auto add = [&](const std::string & name, std::vector<int32_t> ne, bool f16) {
+        int64_t n = 1;
+        for (int32_t x : ne) {
+            n *= x;
+        }
+
+        const int32_t hdr[3] = { (int32_t) ne.size(), (int32_t) name.size(), f16 ? 1 : 0 };
+        res.insert(res.end(), (const char *) hdr, (const char *) (hdr + 3));
+        res.insert(res.end(), (const char *) ne.data(), (const char *) (ne.data() + ne.size()));
+        res.insert(res.end(), name.begin(), name.end());
+
+        for (int64_t i = 0; i < n; ++i) {
+            const float v = dist(rng);
+            if (f16) {
+                const ggml_fp16_t h = ggml_fp32_to_fp16(v);
+                res.insert(res.end(), (const char *) &h, (const char *) (&h + 1));
+            } else {
+                res.insert(res.end(), (const char *) &v, (const char *) (&v + 1));
+            }
+        }
+    };
+
+    auto add_block = [&](const std::string & prefix, bool cross) {
+        add(prefix + "mlp_ln.weight", { n_state }, false);
+        add(prefix + "mlp_ln.bias",   { n_state }, false);
+        add(prefix + "mlp.0.weight",  { n_state, 4*n_state }, true);
+        add(prefix + "mlp.0.bias",    { 4*n_state }, false);
+        add(prefix + "mlp.2.weight",  { 4*n_state, n_state }, true);
+        add(prefix + "mlp.2.bias",    { n_state }, false);
+
+        for (const std::string a : { "attn", "cross_attn" }) {
+            if (a == "cross_attn" && !cross) {
+                continue;
+            }
+            add(prefix + a + "_ln.weight",    { n_state }, false);
+            add(prefix + a + "_ln.bias",      { n_state }, false);
+            add(prefix + a + ".query.weight", { n_state, n_state }, true);
+            add(prefix + a + ".query.bias",   { n_state }, false);
+            add(prefix + a + ".key.weight",   { n_state, n_state }, true);
+            add(prefix + a + ".value.weight", { n_state, n_state }, true);
+            add(prefix + a + ".value.bias",   { n_state }, false);
+            add(prefix + a + ".out.weight",   { n_state, n_state }, true);
+            add(prefix + a + ".out.bias",     { n_state }, false);
+        }
+    };
+
+    add("encoder.positional_embedding", { n_state, n_ctx_a }, false);
+    add("encoder.conv1.weight", { 3, n_mels, n_state }, true);
+    add("encoder.conv1.bias",   { 1, n_state }, false);
+    add("encoder.conv2.weight", { 3, n_state, n_state }, true);
+    add("encoder.conv2.bias",   { 1, n_state }, false);
+    add("encoder.ln_post.weight", { n_state }, false);
+    add("encoder.ln_post.bias",   { n_state }, false);
+    for (int i = 0; i < n_layer; ++i) {
+        add_block("encoder.blocks." + std::to_string(i) + ".", false);
+    }
+
+    add("decoder.positional_embedding",   { n_state, n_ctx_t }, false);
+    add("decoder.token_embedding.weight", { n_state, n_vocab }, true);
+    add("decoder.ln.weight", { n_state }, false);
+    add("decoder.ln.bias",   { n_state }, false);
+    for (int i = 0; i < n_text_layer; ++i) {
+        add_block("decoder.blocks." + std::to_string(i) + ".", true);
+    }
+
+    return res;
+}
+
+struct whisper_context * init_context(std::vector<char> & model) {
+    struct whisper_context_params cparams = whisper_context_default_params();
+    cparams.use_gpu = false;
+
+    struct whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(model.data(), model.size(), cparams);
+    assert(ctx != nullptr);
+
+    return ctx;
+}
+
+std::vector<whisper_token> transcribe(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * pcmf32,
+                           int   n_samples) {
+    struct whisper_full_params wparams = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+    wparams.n_threads      = 1;
+    wparams.language       = "en";
+    wparams.print_progress = false;
+    wparams.no_timestamps  = true;
+    wparams.temperature_inc = 0.0f;
+
+    // the random model stops early - generate a fixed number of tokens
+    wparams.logits_filter_callback = [](struct whisper_context * ctx, struct whisper_state *, const whisper_token_data *, int n_tokens, float * logits, void *) {
+        if (n_tokens < 32) {
+            logits[whisper_token_eot(ctx)] = -INFINITY;
+        }
+    };
+
+    assert(whisper_full_with_state(ctx, state, wparams, pcmf32, n_samples) == 0);
+
+    std::vector<whisper_token> res;
+    for (int i = 0; i < whisper_full_n_segments_from_state(state); ++i) {
+        for (int j = 0; j < whisper_full_n_tokens_from_state(state, i); ++j) {
+            res.push_back(whisper_full_get_token_id_from_state(state, i, j));
+        }
+    }
+
+    return res;
+}
+
+// two states transcribing different audio at the same time must give the same tokens with and without a batcher
+void test_batcher(struct whisper_context * ctx, const std::vector<float> & pcm_a, const std::vector<float> & pcm_b) {
+    struct whisper_state * state_a = whisper_init_state(ctx);
+    struct whisper_state * state_b = whisper_init_state(ctx);
+    assert(state_a != nullptr && state_b != nullptr);
+
+    const std::vector<whisper_token> ref_a = transcribe(ctx, state_a, pcm_a.data(), pcm_a.size());
+    const std::vector<whisper_token> ref_b = transcribe(ctx, state_b, pcm_b.data(), pcm_b.size());
+
+    assert(!ref_a.empty() && !ref_b.empty());
+    assert(ref_a != ref_b);
+
+    struct whisper_batcher * batcher = whisper_batcher_init(ctx, 2, 100000);
+    assert(batcher != nullptr);
+
+    assert(whisper_state_set_batcher(state_a, batcher) == 0);
+    assert(whisper_state_set_batcher(state_b, batcher) == 0);
+
+    std::vector<whisper_token> res_a;
+    std::vector<whisper_token> res_b;
+
+    std::thread th([&]() { res_b = transcribe(ctx, state_b, pcm_b.data(), pcm_b.size()); });
+    res_a = transcribe(ctx, state_a, pcm_a.data(), pcm_a.size());
+    th.join();
+
+    printf("batcher: %d and %d tokens\n", (int) res_a.size(), (int) res_b.size());
+
+    assert(res_a == ref_a);
+    assert(res_b == ref_b);
+
+    assert(whisper_state_set_batcher(state_a, nullptr) == 0);
+    assert(whisper_state_set_batcher(state_b, nullptr) == 0);
+
+    whisper_batcher_free(batcher);
+
+    whisper_free_state(state_a);
+    whisper_free_state(state_b);
+}
+
+// the logits of the first token after SOT for the window encoded in the state
+// they depend on all of the cross-attention memory, so they tell apart windows that were not encoded the same way
+std::vector<float> decode_sot(struct whisper_context * ctx, struct whisper_state * state) {
+    const whisper_token sot = whisper_token_sot(ctx);
+
+    assert(whisper_decode_with_state(ctx, state, &sot, 1, 0, 1) == 0);
+
+    const float * logits = whisper_get_logits_from_state(state);
+
+    return std::vector<float>(logits, logits + whisper_n_vocab(ctx));
+}
+
+// the windows encoded in a single batched graph must match the ones encoded one at a time
+void test_encode_batch(struct whisper_context * ctx, const std::vector<float> & pcm, const std::vector<int> & offsets) {
+    const int n_windows = offsets.size();
+
+    std::vector<whisper_state *> states(n_windows);
+
+    // the reference windows are encoded one after the other in the same state
+    struct whisper_state * state_ref = whisper_init_state(ctx);
+    assert(state_ref != nullptr);
+
+    std::vector<std::vector<float>> refs(n_windows);
+
+    for (int i = 0; i < n_windows; ++i) {
+        states[i] = whisper_init_state(ctx);
+        assert(states[i] != nullptr);
+
+        // different audio in each state
+        const int n_skip = (i % 8)*WHISPER_SAMPLE_RATE;
+
+        assert(whisper_pcm_to_mel_with_state(ctx, states[i], pcm.data() + n_skip, pcm.size() - n_skip, 1) == 0);
+        assert(whisper_pcm_to_mel_with_state(ctx, state_ref, pcm.data() + n_skip, pcm.size() - n_skip, 1) == 0);
+
+        assert(whisper_encode_with_state(ctx, state_ref, offsets[i], 1) == 0);
+
+        refs[i] = decode_sot(ctx, state_ref);
+    }
+
+    assert(whisper_encode_batch(ctx, states.data(), offsets.data(), n_windows, 1) == 0);
+
+    std::vector<float> first;
+
+    for (int i = 0; i < n_windows; ++i) {
+        const std::vector<float> res = decode_sot(ctx, states[i]);
+        const std::vector<float> & ref = refs[i];
+
+        float err_max = 0.0f;
+        for (size_t j = 0; j < res.size(); ++j) {
+            err_max = std::max(err_max, std::fabs(res[j] - ref[j]));
+        }
+
+        printf("encode batch: window %d, max error = %g\n", i, err_max);
+
+        assert(err_max < 1e-4f);
+
+        // the windows differ from each other
+        if (i == 0) {
+            first = ref;
+        } else {
+            assert(ref != first);
+        }
+    }
+
+    for (int i = 0; i < n_windows; ++i) {
+        whisper_free_state(states[i]);
+    }
+
+    whisper_free_state(state_ref);
+}
+
+int main() {
+    std::string model_path  = "../../models/for-tests-ggml-tiny.en.bin";
+    std::string sample_path = "../../samples/jfk.wav";
+
+    std::vector<float> pcmf32;
+    std::vector<std::vector<float>> pcmf32s;
+    assert(read_audio_data(sample_path.c_str(), pcmf32, pcmf32s, false));
+
+    // a second input: the second half of the sample
+    const std::vector<float> pcmf32_half(pcmf32.begin() + pcmf32.size()/2, pcmf32.end());
+
+    std::vector<char> model = make_random_model(model_path);
+
+    struct whisper_context * ctx = init_context(model);
+
+    test_batcher(ctx, pcmf32, pcmf32_half);
+
+    test_encode_batch(ctx, pcmf32, { 0, 150, 400 });
+
+    whisper_free(ctx);
+
+    // with a deep decoder, the cross-attention memory of many windows does not fit in a graph of the default size
+    {
+        std::vector<char> model_deep = make_random_model(model_path, 32);
+
+        struct whisper_context * ctx_deep = init_context(model_deep);
+
+        std::vector<int> offsets;
+        for (int i = 0; i < 20; ++i) {
+            offsets.push_back(25*i);
+        }
+
+        test_encode_batch(ctx_deep, pcmf32, offsets);
+
+        whisper_free(ctx_deep);
+    }
+
+    return 0;
+}
@@ -1,8 +1,11 @@
 #include "whisper.h"
 #include "common-whisper.h"
 
+#include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <string>
+#include <vector>
 
 #ifdef NDEBUG
 #undef NDEBUG
@@ -47,6 +50,100 @@ struct whisper_vad_segments * test_detect_timestamps(
     return timestamps;
 }
 
+void test_push_samples(
+        struct whisper_vad_context * vctx,
+        struct whisper_vad_params params,
+        const float * pcmf32,
+        int n_samples) {
+    whisper_vad_stream_reset(vctx);
+
+    // 100 ms at a time, the events have to alternate between start and end
+    const int n_step = 1600;
+
+    int n_start = 0;
+    int n_end   = 0;
+
+    int64_t t_last = 0;
+
+    auto check_events = [&](int n_events) {
+        assert(n_events >= 0);
+
+        const struct whisper_vad_event * events = whisper_vad_events(vctx);
+        for (int j = 0; j < n_events; ++j) {
+            if (events[j].type == WHISPER_VAD_EVENT_SPEECH_START) {
+                assert(n_start == n_end);
+                n_start++;
+            } else {
+                assert(n_start == n_end + 1);
+                n_end++;
+            }
+            assert(events[j].t >= t_last);
+            t_last = events[j].t;
+            printf("VAD event %d: %s at %.2f\n", j, events[j].type == WHISPER_VAD_EVENT_SPEECH_START ? "start" : "end", events[j].t/100.0);
+        }
+    };
+
+    for (int i = 0; i < n_samples; i += n_step) {
+        check_events(whisper_vad_push_samples(vctx, params, pcmf32 + i, std::min(n_step, n_samples - i)));
+    }
+
+    check_events(whisper_vad_flush(vctx, params));
+
+    assert(n_start >= 5);
+    assert(n_start == n_end);
+
+    // a stream that ends in speech: stop right after the start of the first segment
+    whisper_vad_stream_reset(vctx);
+
+    n_start = n_end = 0;
+    t_last = 0;
+
+    int n_pushed = 0;
+    while (n_start == 0) {
+        assert(n_pushed < n_samples);
+        check_events(whisper_vad_push_samples(vctx, params, pcmf32 + n_pushed, n_step));
+        n_pushed += n_step;
+    }
+
+    // the last 100 ms do not fill a whole number of chunks
+    check_events(whisper_vad_push_samples(vctx, params, pcmf32 + n_pushed, 1000));
+    n_pushed += 1000;
+
+    check_events(whisper_vad_flush(vctx, params));
+
+    assert(n_end == 1);
+    assert(t_last <= (100*n_pushed)/WHISPER_SAMPLE_RATE + 1);
+}
+
+void test_detect_speech_parallel(
+        struct whisper_vad_context * vctx,
+        struct whisper_vad_params params,
+        const float * pcmf32,
+        int n_samples) {
+    assert(whisper_vad_detect_speech(vctx, pcmf32, n_samples));
+    const std::vector<float> probs(whisper_vad_probs(vctx), whisper_vad_probs(vctx) + whisper_vad_n_probs(vctx));
+
+    // 2 shards with 500 ms of warm-up
+    assert(whisper_vad_detect_speech_parallel(vctx, pcmf32, n_samples, 2, 500));
+    assert(whisper_vad_n_probs(vctx) == (int) probs.size());
+
+    // the LSTM state of the second shard does not fully converge to the sequential one
+    float err_max = 0.0f;
+    double err_sum = 0.0;
+    for (int i = 0; i < (int) probs.size(); ++i) {
+        const float err = std::fabs(whisper_vad_probs(vctx)[i] - probs[i]);
+        err_max = std::max(err_max, err);
+        err_sum += err;
+    }
+    printf("VAD shards: max error = %.4f, mean error = %.4f\n", err_max, err_sum/probs.size());
+
+    assert(err_max < 0.25f);
+
+    struct whisper_vad_segments * timestamps = whisper_vad_segments_from_probs(vctx, params);
+    assert(whisper_vad_segments_n_segments(timestamps) == 5);
+    whisper_vad_free_segments(timestamps);
+}
+
 int main() {
     std::string vad_model_path = "../../models/for-tests-silero-v5.1.2-ggml.bin";
     std::string sample_path    = "../../samples/jfk.wav";
@@ -77,6 +174,13 @@ int main() {
     struct whisper_vad_segments * timestamps = test_detect_timestamps(vctx, params);
 
     whisper_vad_free_segments(timestamps);
+
+    // Test the sharded detection against the sequential one
+    test_detect_speech_parallel(vctx, params, pcmf32.data(), pcmf32.size());
+
+    // Test the streaming detection
+    test_push_samples(vctx, params, pcmf32.data(), pcmf32.size());
+
     whisper_vad_free(vctx);
 
     return 0;